@@ -0,0 +1,150 @@
+#include "ack_tracker.hpp"
+#include "protocol.hpp"
+#include "main.hpp"
+
+using namespace std;
+
+#define PRODUCER_SWEEP_INTERVAL 10
+#define PRODUCER_IDLE_TIMEOUT   60
+
+ack_tracker::ack_tracker()
+    : lastSweep(chrono::steady_clock::now()), batch(64), interval(chrono::milliseconds(5))
+{
+}
+
+void ack_tracker::received(zmq::socket_t &socket, const string &producer, uint64_t seq, steady_time_t now)
+{
+    producer_acks_t &state = producers[producer];
+
+    if (state.expected == 0 && seq > 1)
+    {
+        // producer came from another broker: what it sent before may have been left unread there, and our
+        // cumulative acks would cover it, so have it sent again; acknowledged messages are not resent
+        state.pending = 0;
+
+        sendReject(socket, producer, 1, seq - 1);
+    }
+    else if (state.expected == 0 || seq < state.expected)
+    {
+        // first message, or the producer was restarted with the same identity
+        state.pending = 0;
+    }
+    else if (seq > state.expected)
+    {
+        sendReject(socket, producer, state.expected, seq - 1);
+    }
+
+    state.expected = seq + 1;
+    state.seen = now;
+}
+
+void ack_tracker::accepted(zmq::socket_t &socket, const string &producer, uint64_t seq, steady_time_t now)
+{
+    unordered_map<string, producer_acks_t>::iterator it = producers.find(producer);
+
+    if (it == producers.end())
+    {
+        return;
+    }
+
+    producer_acks_t &state = it->second;
+
+    state.accepted = seq;
+
+    if (state.pending++ == 0)
+    {
+        state.started = now;
+        deadlines.push_back(make_pair(now, producer));
+    }
+
+    if (state.pending >= batch)
+    {
+        sendAck(socket, producer, state);
+    }
+}
+
+void ack_tracker::rejected(zmq::socket_t &socket, const string &producer, uint64_t seq)
+{
+    sendReject(socket, producer, seq, seq);
+}
+
+void ack_tracker::flush(zmq::socket_t &socket, steady_time_t now, bool all)
+{
+    // deadlines are queued in the order they were started, so the front always expires first
+    while (!deadlines.empty() && (all || deadlines.front().first + interval <= now))
+    {
+        unordered_map<string, producer_acks_t>::iterator it = producers.find(deadlines.front().second);
+
+        // acks could be sent by batch size already and maybe started again since then
+        if (it != producers.end() && it->second.pending > 0 && it->second.started == deadlines.front().first)
+        {
+            sendAck(socket, it->first, it->second);
+        }
+
+        deadlines.pop_front();
+    }
+
+    if (now - lastSweep < chrono::seconds(PRODUCER_SWEEP_INTERVAL))
+    {
+        return;
+    }
+
+    lastSweep = now;
+
+    for (unordered_map<string, producer_acks_t>::iterator it = producers.begin(); it != producers.end();)
+    {
+        if (it->second.pending == 0 && now - it->second.seen > chrono::seconds(PRODUCER_IDLE_TIMEOUT))
+        {
+            it = producers.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+void ack_tracker::sendAck(zmq::socket_t &socket, const string &producer, producer_acks_t &state)
+{
+    zmq::message_t identity(producer.size());
+    zmq::message_t ack(1 + SEQ_SIZE);
+
+    memcpy(identity.data(), producer.data(), producer.size());
+
+    *static_cast<char *>(ack.data()) = ACK_ACCEPTED;
+    encodeSeq(state.accepted, static_cast<char *>(ack.data()) + 1);
+
+    try
+    {
+        socket.send(identity, ZMQ_SNDMORE);
+        socket.send(ack);
+    }
+    catch (zmq::error_t e)
+    {
+        ERR << "Ack faied: error " << e.num() << ": " << e.what();
+    }
+
+    state.pending = 0;
+}
+
+void ack_tracker::sendReject(zmq::socket_t &socket, const string &producer, uint64_t first, uint64_t last)
+{
+    zmq::message_t identity(producer.size());
+    zmq::message_t reject(1 + 2 * SEQ_SIZE);
+
+    memcpy(identity.data(), producer.data(), producer.size());
+
+    *static_cast<char *>(reject.data()) = ACK_REJECTED;
+    encodeSeq(first, static_cast<char *>(reject.data()) + 1);
+    encodeSeq(last, static_cast<char *>(reject.data()) + 1 + SEQ_SIZE);
+
+    try
+    {
+        socket.send(identity, ZMQ_SNDMORE);
+        socket.send(reject);
+    }
+    catch (zmq::error_t e)
+    {
+        ERR << "Ack faied: error " << e.num() << ": " << e.what();
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef SERVICE_QUEUE_ACK_TRACKER_H
+#define SERVICE_QUEUE_ACK_TRACKER_H
+
+#include "zmq.hpp"
+#include "rate_limiter.hpp"
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+using namespace std;
+
+typedef struct
+{
+    uint64_t      expected; // next seq, 0 - nothing received yet
+    uint64_t      accepted; // last seq accepted but not acknowledged yet
+    unsigned int  pending;  // accepted messages not acknowledged yet
+    steady_time_t started;  // first pending message
+    steady_time_t seen;
+} producer_acks_t;
+
+// Cumulative acknowledgements for producers on the acknowledged input.
+// Acks are sent when batch messages are pending for a producer or interval after the first of them was accepted.
+class ack_tracker
+{
+
+private:
+    unordered_map<string, producer_acks_t> producers;
+    deque<pair<steady_time_t, string> >    deadlines;
+    steady_time_t                          lastSweep;
+
+    unsigned int         batch;
+    chrono::microseconds interval;
+
+    void sendAck(zmq::socket_t &socket, const string &producer, producer_acks_t &state);
+    void sendReject(zmq::socket_t &socket, const string &producer, uint64_t first, uint64_t last);
+
+public:
+    ack_tracker();
+
+    void configure(unsigned int batch, long intervalMs)
+    {
+        ack_tracker::batch = batch < 1 ? 1 : batch;
+        ack_tracker::interval = chrono::milliseconds(intervalMs);
+    }
+
+    // Rejects the range lost in transit when seq skips ahead
+    void received(zmq::socket_t &socket, const string &producer, uint64_t seq, steady_time_t now);
+
+    void accepted(zmq::socket_t &socket, const string &producer, uint64_t seq, steady_time_t now);
+
+    void rejected(zmq::socket_t &socket, const string &producer, uint64_t seq);
+
+    void flush(zmq::socket_t &socket, steady_time_t now, bool all);
+
+    bool pending() const
+    {
+        return !deadlines.empty();
+    }
+
+    steady_time_t nextDeadline() const
+    {
+        return deadlines.front().first + interval;
+    }
+};
+
+#endif //SERVICE_QUEUE_ACK_TRACKER_H
@@ -1,342 +1,2740 @@
 #include "broker.hpp"
 #include "main.hpp"
-#include <json/json.h>
-#include <thread>
+#include "protocol.hpp"
+#include "fnv.hpp"
+#include <algorithm>
 #include <chrono>
+#include <sstream>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <time.h>
 
 using namespace std;
 
+// answered since it was restored, is not held out of dispatch by an admin command and was not found gone
+static bool eligible(const worker_t &worker)
+{
+    return worker.probeUntil == steady_time_t() && !worker.quarantined && !worker.retiring && !worker.unreachable;
+}
+
+// eligible and has spare credit
+static bool ready(const worker_t &worker)
+{
+    return (worker.credit == 0 || worker.outstanding < worker.credit) && eligible(worker);
+}
+
+// not connected to output, a send to it failed for that reason rather than a full queue
+static bool disconnected(const worker_t &worker)
+{
+    return worker.unreachable || worker.probeUntil != steady_time_t();
+}
+
+static const char *transportNames[] = {"inproc", "ipc", "loopback", "network"};
+
+static transport_t transportOf(const string &endpoint, const string &host)
+{
+    if (endpoint.compare(0, 9, "inproc://") == 0)
+    {
+        return TRANSPORT_INPROC;
+    }
+
+    if (endpoint.compare(0, 6, "ipc://") == 0)
+    {
+        return TRANSPORT_IPC;
+    }
+
+    if (endpoint.compare(0, 6, "tcp://") == 0)
+    {
+        size_t port    = endpoint.rfind(':');
+        string address = endpoint.substr(6, port > 6 ? port - 6 : string::npos);
+
+        if (address.compare(0, 4, "127.") == 0 || address == "localhost" || address == "[::1]" || address == host)
+        {
+            return TRANSPORT_LOOPBACK;
+        }
+    }
+
+    return TRANSPORT_NETWORK;
+}
+
+// timing wheel ticks
+static uint64_t milliseconds(steady_time_t time)
+{
+    return chrono::duration_cast<chrono::milliseconds>(time.time_since_epoch()).count();
+}
+
+// {"delay_ms": 5000} or {"deliver_at": <unix time in ms>}, zero when neither is set or the time has passed
+static steady_time_t deliveryTime(const zmq::message_t &header, steady_time_t now)
+{
+    slice_t  json  = sliceOf(header);
+    uint64_t delay = jsonUInt64(json, "delay_ms", 0);
+    uint64_t at    = jsonUInt64(json, "deliver_at", 0);
+
+    if (at > 0)
+    {
+        uint64_t wallClock = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+        delay = at > wallClock ? at - wallClock : 0;
+    }
+
+    return delay > 0 ? now + chrono::milliseconds(delay) : steady_time_t();
+}
+
+// {"idempotency_key": "..."}, hashed as it is in the header
+static bool idempotencyKey(const zmq::message_t &header, uint64_t &key)
+{
+    slice_t value;
+
+    if (!findJsonValue(sliceOf(header), "idempotency_key", value) || value.size == 0)
+    {
+        return false;
+    }
+
+    key = fnv1a64(value.data, value.size);
+
+    return true;
+}
+
+static bool readable(zmq::socket_t &socket)
+{
+    int    events      = 0;
+    size_t events_size = sizeof(events);
+
+    socket.getsockopt(ZMQ_EVENTS, &events, &events_size);
+
+    return events & ZMQ_POLLIN;
+}
+
+int broker::signalFd = -1;
+
 void broker::run()
 {
     LOG << "Service queue started";
 
+    if (pipe2(wakeup, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        ERR << "Wakeup pipe failed: " << strerror(errno);
+
+        return;
+    }
+
+    signalFd = wakeup[1];
+
+    if (compressionThreads > 0 && availableCodecs() == "[]")
+    {
+        LOG << "Compression: no codec built in, payloads are sent as they are";
+    }
+    else if (compressionThreads > 0)
+    {
+        compressing.start(compressionThreads, wakeup[1]);
+
+        LOG << "Compression: " << availableCodecs() << " on " << compressionThreads << " threads, payloads from "
+            << compressionThreshold << " bytes";
+    }
+
     signal(SIGINT,  broker::signalHandler);
     signal(SIGTERM, broker::signalHandler);
     signal(SIGHUP,  broker::signalHandler);
+    signal(SIGUSR1, broker::signalHandler);
 
     connect();
 
-    thread          serviceThread = thread(&broker::dispatchService, this);
-    thread          heartbeatThread = thread(&broker::heartbeat, this);
-    string          worker;
-    zmq::message_t  message;
-    zmq::pollitem_t pollItems[]   = {{*input, 0, ZMQ_POLLIN, 0}};
+    for (vector<peer_link>::iterator it = peers.begin(); it < peers.end(); it++)
+    {
+        (*it).connect(*ctx, "federation:" + federationName, federationCredit);
+    }
+
+    buildPollItems();
+
+    steady_time_t now = chrono::steady_clock::now();
+
+    nextHeartbeat = now;
+    nextKeepAlive = now;
+    statsDue = now + chrono::seconds(METRICS_LOG_INTERVAL);
+    superviseDue = now;
+    deadLettersFlushed = now;
+    snapshotDue = now + chrono::seconds(WORKER_SNAPSHOT_INTERVAL);
 
-    while (true)
+    if (!snapshotPath.empty())
     {
+        restoreWorkers(now);
+    }
+
+    while (!interrupted)
+    {
+        if (pollItemsChanged)
+        {
+            buildPollItems();
+        }
+
+        now = chrono::steady_clock::now();
+
+        runTimers(now);
+
+        removeUnreachable();
+
+        if (holding && holdUntil <= now && dispatchInput(held, now))
+        {
+            holding = false;
+        }
+
+        dispatchUnsent(now);
+        dispatchFair(now);
+        dispatchDelayed(now);
+        dispatchStreams();
+        dispatchForeign();
+        sendCompressed();
+
+        if (draining && ((queuedMessages() == 0 && inFlightMessages() == 0 && !acks.pending()) ||
+                         drainStarted + drainTimeout <= now))
+        {
+            break;
+        }
+
+        // held input keeps the rest in the socket queue, so ZMQ HWM pushes back on the producers;
+        // fair input is queued per tenant meanwhile and stops only when the queues are full,
+        // broadcasts do not wait for workers at all, no input is read while draining
+        for (size_t i = 2; i < peersIndex; i++)
+        {
+            if (draining)
+            {
+                pollItems[i].events = 0;
+            }
+            else if (i != broadcastIndex)
+            {
+                pollItems[i].events = (i == fairIndex ? fair.full() : holding) ? 0 : ZMQ_POLLIN;
+            }
+        }
+
         try
         {
-            zmq::poll(pollItems, 1, 1000);
+            zmq::poll(&pollItems[0], pollItems.size(), pollTimeout(now));
         }
         catch (zmq::error_t e)
         {
+            // EINTR, the signal itself is read from the wakeup pipe
         }
 
         if (pollItems[0].revents & ZMQ_POLLIN)
         {
-            input->recv(&message);
+            handleSignals();
+        }
+
+        // sockets could be closed by a reload
+        if (pollItemsChanged)
+        {
+            continue;
+        }
+
+        now = chrono::steady_clock::now();
+
+        bool caughtUp = !holding && !draining;
+
+        for (size_t i = 2; i < peersIndex; i++)
+        {
+            caughtUp = caughtUp && !(pollItems[i].revents & ZMQ_POLLIN);
+        }
+
+        // input that waits for a worker shows in the socket queues, not here; it is behind until all is read
+        if (caughtUp)
+        {
+            starvedSince = steady_time_t();
+        }
+
+        // output is only written to, but libzmq frees the pipes of a disconnected worker once the socket is checked
+        // for input; without this every worker that ever went away stays allocated
+        readable(*output);
+
+        for (int i = 0; i < POLL_BURST && pollItems[1].revents & ZMQ_POLLIN && (i == 0 || readable(*service)); i++)
+        {
+            dispatchService();
+        }
+
+        if (pollItems[2].revents & ZMQ_POLLIN)
+        {
+            receiveInputs(*input, false, now);
+        }
+
+        if (ackIndex > 0 && pollItems[ackIndex].revents & ZMQ_POLLIN)
+        {
+            receiveInputs(*ackInput, true, now);
+        }
+
+        if (fairIndex > 0 && pollItems[fairIndex].revents & ZMQ_POLLIN)
+        {
+            receiveFair();
+        }
+
+        if (broadcastIndex > 0 && pollItems[broadcastIndex].revents & ZMQ_POLLIN)
+        {
+            receiveBroadcasts();
+        }
+
+        for (size_t i = peersIndex; i < pollItems.size(); i++)
+        {
+            if (pollItems[i].revents & ZMQ_POLLIN)
+            {
+                receiveForeign(peers[i - peersIndex]);
+            }
+        }
+    }
+
+    now = chrono::steady_clock::now();
+
+    if (draining)
+    {
+        size_t queued   = queuedMessages();
+        size_t inFlight = inFlightMessages();
+
+        if (queued == 0 && inFlight == 0)
+        {
+            LOG << "Drained in " << chrono::duration_cast<chrono::milliseconds>(now - drainStarted).count() << " ms";
+        }
+        else
+        {
+            ERR << "Drain " << (interrupted ? "interrupted" : "timed out") << ": " << queued << " queued and " << inFlight << " in flight messages abandoned";
+        }
+    }
+
+    flushBatches(now, true);
+
+    compressing.stop();
+
+    sendCompressed();
+
+    if (ackInput != NULL)
+    {
+        acks.flush(*ackInput, now, true);
+    }
+
+    if (snapshotDirty && !snapshotPath.empty())
+    {
+        saveWorkers();
+    }
+
+    LOG << "Shutting down all workers";
+
+    shutdownAllWorkers();
+
+    stopLocalWorkers();
+
+    if (delayed.size() > 0)
+    {
+        deque<delayed_message_t> pending;
+
+        delayed.takeAll(pending);
+
+        ERR << "Delayed: " << pending.size() << " messages not due yet "
+            << (deadLetters.isOpen() ? "written to dead letters" : "abandoned");
+
+        for (deque<delayed_message_t>::iterator it = pending.begin(); it != pending.end(); it++)
+        {
+            deadLetter("", (*it).payload, DEAD_NOT_DUE);
+        }
+    }
+
+    (*deadLettersFailed) += deadLetters.close();
+
+    logStats();
+
+    if (!foreign.empty())
+    {
+        ERR << "Federation: " << foreign.size() << " foreign messages abandoned";
+    }
+
+    for (vector<peer_link>::iterator it = peers.begin(); it < peers.end(); it++)
+    {
+        (*it).unregister();
+        (*it).close();
+    }
+
+    LOG << "Service queue finished";
+}
+
+void broker::buildPollItems()
+{
+    pollItems.clear();
+
+    // wakeup, service, input, ack input, fair input and broadcast input come first, peer links after them
+    zmq::pollitem_t wakeupItem  = {NULL, wakeup[0], ZMQ_POLLIN, 0};
+    zmq::pollitem_t serviceItem = {*service, 0, ZMQ_POLLIN, 0};
+    zmq::pollitem_t inputItem   = {*input, 0, ZMQ_POLLIN, 0};
+
+    pollItems.push_back(wakeupItem);
+    pollItems.push_back(serviceItem);
+    pollItems.push_back(inputItem);
+
+    ackIndex = 0;
+    fairIndex = 0;
+    broadcastIndex = 0;
+
+    if (ackInput != NULL)
+    {
+        zmq::pollitem_t ackInputItem = {*ackInput, 0, ZMQ_POLLIN, 0};
+
+        ackIndex = pollItems.size();
+        pollItems.push_back(ackInputItem);
+    }
+
+    if (fairInput != NULL)
+    {
+        zmq::pollitem_t fairInputItem = {*fairInput, 0, ZMQ_POLLIN, 0};
+
+        fairIndex = pollItems.size();
+        pollItems.push_back(fairInputItem);
+    }
+
+    if (broadcastInput != NULL)
+    {
+        zmq::pollitem_t broadcastInputItem = {*broadcastInput, 0, ZMQ_POLLIN, 0};
+
+        broadcastIndex = pollItems.size();
+        pollItems.push_back(broadcastInputItem);
+    }
+
+    peersIndex = pollItems.size();
+
+    for (vector<peer_link>::iterator it = peers.begin(); it < peers.end(); it++)
+    {
+        zmq::pollitem_t item = {*(*it).getOutput(), 0, ZMQ_POLLIN, 0};
+
+        pollItems.push_back(item);
+    }
+
+    pollItemsChanged = false;
+}
+
+void broker::reload()
+{
+    if (!reloadHandler)
+    {
+        return;
+    }
+
+    LOG << "Reloading configuration";
+
+    string         previous[] = {inputDSN, "", serviceDSN, ackInputDSN, fairInputDSN, broadcastInputDSN};
+    vector<string> previousOutputs = outputDSNs;
+
+    // the handler applies nothing unless the whole config is valid
+    if (!reloadHandler())
+    {
+        ERR << "Reload failed, the running configuration is kept";
+
+        return;
+    }
+
+    // workers stay connected unless output or service moved, messages held or in flight are kept either way
+    rebind(*input, inputDSN, previous[0], "input");
+    rebindOutputs(previousOutputs);
+    rebind(*service, serviceDSN, previous[2], "service");
+
+    openInput(ackInput, ZMQ_ROUTER, ackInputDSN, previous[3], "ack input");
+    openInput(fairInput, ZMQ_ROUTER, fairInputDSN, previous[4], "fair input");
+    openInput(broadcastInput, ZMQ_PULL, broadcastInputDSN, previous[5], "broadcast input");
+
+    pollItemsChanged = true;
+
+    // new heartbeat intervals apply from now on
+    nextHeartbeat = chrono::steady_clock::now();
+
+    LOG << "Configuration reloaded";
+}
+
+void broker::rebind(zmq::socket_t &socket, string &dsn, const string &previous, const char *name)
+{
+    if (dsn == previous)
+    {
+        return;
+    }
+
+    try
+    {
+        socket.unbind(previous.c_str());
+        socket.bind(dsn.c_str());
+
+        LOG << "Listen: " << name << " moved to " << dsn;
+    }
+    catch (zmq::error_t e)
+    {
+        ERR << "Listen: " << name << " on " << dsn << " failed: " << e.what() << ", staying on " << previous;
 
-            getNextWorker(worker);
+        dsn = previous;
 
-            writeLock.lock();
+        try
+        {
+            socket.bind(previous.c_str());
+        }
+        catch (zmq::error_t e)
+        {
+            // still bound, unbind was what failed
+        }
+    }
+}
 
+void broker::rebindOutputs(const vector<string> &previous)
+{
+    // workers on an endpoint that stays are not disturbed
+    for (vector<string>::const_iterator it = previous.begin(); it < previous.end(); it++)
+    {
+        if (find(outputDSNs.begin(), outputDSNs.end(), *it) == outputDSNs.end())
+        {
             try
             {
-                sendMore(worker);
-                send(message);
+                output->unbind((*it).c_str());
+
+                LOG << "Listen: output closed on " << *it;
             }
             catch (zmq::error_t e)
             {
-                ERR << "Send faied [" << worker << "]: error " << e.num() << ": " << e.what();
+                ERR << "Listen: output on " << *it << " failed to close: " << e.what();
             }
+        }
+    }
+
+    for (vector<string>::iterator it = outputDSNs.begin(); it < outputDSNs.end();)
+    {
+        if (find(previous.begin(), previous.end(), *it) != previous.end())
+        {
+            it++;
+
+            continue;
+        }
+
+        try
+        {
+            output->bind((*it).c_str());
+
+            LOG << "Listen: output added on " << *it;
+
+            it++;
+        }
+        catch (zmq::error_t e)
+        {
+            ERR << "Listen: output on " << *it << " failed: " << e.what();
+
+            it = outputDSNs.erase(it);
+        }
+    }
+}
+
+void broker::openInput(zmq::socket_t *&socket, int type, string &dsn, const string &previous, const char *name)
+{
+    if (dsn == previous)
+    {
+        return;
+    }
+
+    if (socket != NULL)
+    {
+        socket->close();
+
+        delete socket;
+
+        socket = NULL;
+
+        LOG << "Closed: " << name << " on " << previous;
+    }
+
+    if (dsn.empty())
+    {
+        return;
+    }
+
+    socket = new zmq::socket_t(*ctx, type);
+
+    try
+    {
+        socket->bind(dsn.c_str());
+
+        LOG << "Listen: " << name << " on " << dsn;
+    }
+    catch (zmq::error_t e)
+    {
+        ERR << "Listen: " << name << " on " << dsn << " failed: " << e.what();
+
+        socket->close();
+
+        delete socket;
+
+        socket = NULL;
+        dsn.clear();
+    }
+}
+
+bool broker::setDeadLetters(const string &directory, size_t segmentSize)
+{
+    if (deadLetters.isOpen() && deadLetters.getDirectory() == directory && deadLetters.getSegmentSize() == segmentSize)
+    {
+        return true;
+    }
+
+    // the running store stays if the new one cannot be opened
+    dead_letter_store replacement;
+
+    if (!directory.empty() && !replacement.open(directory, segmentSize))
+    {
+        return false;
+    }
+
+    (*deadLettersFailed) += deadLetters.close();
+
+    deadLetters.swap(replacement);
+
+    return true;
+}
+
+void broker::handleSignals()
+{
+    unsigned char signals[16];
+    ssize_t       count;
+
+    while ((count = read(wakeup[0], signals, sizeof(signals))) > 0)
+    {
+        for (ssize_t i = 0; i < count; i++)
+        {
+            // finished payloads are sent by sendCompressed() in the loop
+            if (signals[i] == COMPRESSOR_WAKEUP)
+            {
+                continue;
+            }
+
+            if (signals[i] == SIGUSR1)
+            {
+                dumpTrace();
+
+                continue;
+            }
+
+            if (signals[i] == SIGHUP)
+            {
+                if (draining)
+                {
+                    ERR << "Reload ignored while draining";
+                }
+                else
+                {
+                    reload();
+                }
+
+                continue;
+            }
+
+            // a second signal while draining stops at once
+            if (signals[i] == SIGTERM && !draining && drainTimeout.count() > 0)
+            {
+                startDrain(chrono::steady_clock::now());
+
+                continue;
+            }
+
+            ERR << "Signal recieved: " << (int) signals[i];
+
+            interrupted = true;
+        }
+    }
+}
+
+void broker::startDrain(steady_time_t now)
+{
+    LOG << "Draining: input closed, waiting up to " << drainTimeout.count() << "s for " << queuedMessages()
+        << " queued and " << inFlightMessages() << " in flight messages";
+
+    draining = true;
+    drainStarted = now;
+
+    // frees the ports for a replacement broker; producers already connected stay attached but are not read,
+    // unacknowledged messages are sent again by acknowledged producers once they reconnect
+    zmq::socket_t *inputs[] = {input, ackInput, fairInput, broadcastInput};
+    string         dsns[]   = {inputDSN, ackInputDSN, fairInputDSN, broadcastInputDSN};
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        if (inputs[i] == NULL)
+        {
+            continue;
+        }
+
+        try
+        {
+            inputs[i]->unbind(dsns[i].c_str());
+        }
+        catch (zmq::error_t e)
+        {
+            ERR << "Unbind " << dsns[i] << " failed: " << e.what();
+        }
+    }
+
+    // peers stop sending us their overflow, what they sent already is still received and handled
+    for (vector<peer_link>::iterator it = peers.begin(); it < peers.end(); it++)
+    {
+        (*it).unregister();
+    }
+
+    // a worker that is gone fails the ping or does not answer it, either way the drain stops waiting for it
+    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+    {
+        if ((*it).probeUntil == steady_time_t() && (*it).lastHeartbitRecieved >= (*it).heartbeatSent)
+        {
+            sendToWorker((*it).name, "ping");
+
+            (*it).heartbeatSent = now;
+        }
+    }
+
+    nextHeartbeat = now;
+}
+
+size_t broker::queuedMessages()
+{
+    size_t queued = fair.size() + due.size() + unsent.size() + streamChunks + foreign.size() + compressing.pending() +
+                    (holding ? 1 : 0);
+
+    for (unordered_map<string, batch_t>::iterator it = batches.begin(); it != batches.end(); it++)
+    {
+        queued += it->second.messages.size();
+    }
+
+    return queued;
+}
+
+size_t broker::inFlightMessages()
+{
+    size_t inFlight = 0;
+
+    // workers without credit never report done, there is nothing to wait for, nor for a gone one
+    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+    {
+        if ((*it).credit > 0 && !(*it).unreachable)
+        {
+            inFlight += (*it).outstanding;
+        }
+    }
+
+    return inFlight;
+}
+
+void broker::dumpTrace()
+{
+    if (!trace.enabled())
+    {
+        ERR << "Trace: sampling is off";
+
+        return;
+    }
+
+    stringstream path;
+
+    path << traceDirectory << "/trace-" << time(NULL) << ".json";
+
+    long written = trace.dump(path.str());
+
+    if (written < 0)
+    {
+        ERR << "Trace: " << path.str() << ": " << strerror(errno);
+
+        return;
+    }
+
+    LOG << "Trace: " << written << " events written to " << path.str();
+}
+
+void broker::runTimers(steady_time_t now)
+{
+    // nothing more is coming while draining, batches and acks are not held back for it
+    flushBatches(now, draining);
+
+    if (ackInput != NULL)
+    {
+        acks.flush(*ackInput, now, draining);
+    }
+
+    if (nextHeartbeat <= now)
+    {
+        nextHeartbeat = heartbeat(now);
+
+        sweepStreams(now);
+    }
+
+    if (!peers.empty() && nextKeepAlive <= now)
+    {
+        time_t seconds;
+
+        time(&seconds);
+
+        // peers are expected to ping as often as we do, a missed ping and the timeout are tolerated
+        long silence = heartbeatInterval.count() * 2 + heartbeatTimeout.count();
+
+        for (vector<peer_link>::iterator it = peers.begin(); it < peers.end(); it++)
+        {
+            (*it).keepAlive(seconds, silence);
+        }
+
+        nextKeepAlive = now + chrono::seconds(1);
+    }
+
+    if (deadLetters.isDirty() && deadLettersFlushed + chrono::seconds(DEAD_LETTER_FLUSH_INTERVAL) <= now)
+    {
+        (*deadLettersFailed) += deadLetters.flush();
+
+        deadLettersFlushed = now;
+    }
+
+    if (snapshotDirty && !snapshotPath.empty() && snapshotDue <= now)
+    {
+        saveWorkers();
+
+        snapshotDue = now + chrono::seconds(WORKER_SNAPSHOT_INTERVAL);
+    }
+
+    if (statsDue <= now)
+    {
+        logStats();
+
+        statsDue = now + chrono::seconds(METRICS_LOG_INTERVAL);
+    }
+
+    // no workers are started for a broker that is going away
+    if (!draining && (localWorkers.enabled() || localWorkers.size() > 0) && superviseDue <= now)
+    {
+        supervise(now);
+
+        superviseDue = now + chrono::milliseconds(SUPERVISOR_INTERVAL_MS);
+    }
+}
+
+void broker::stopLocalWorkers()
+{
+    localWorkers.stopAll(chrono::steady_clock::now());
+
+    // children are reaped on a timer while they exit, SIGKILL follows after stop_timeout or on another signal
+    while (localWorkers.size() > 0)
+    {
+        zmq::pollitem_t signals = {NULL, wakeup[0], ZMQ_POLLIN, 0};
+
+        try
+        {
+            zmq::poll(&signals, 1, SUPERVISOR_REAP_MS);
+        }
+        catch (zmq::error_t e)
+        {
+            // EINTR, the signal itself is read from the wakeup pipe
+        }
+
+        unsigned char numbers[16];
+        ssize_t       count;
+
+        while ((count = read(wakeup[0], numbers, sizeof(numbers))) > 0)
+        {
+            for (ssize_t i = 0; i < count; i++)
+            {
+                if (numbers[i] == SIGINT || numbers[i] == SIGTERM)
+                {
+                    ERR << "Signal recieved: " << (int) numbers[i] << ", not waiting for local workers";
+
+                    localWorkers.killAll();
+                }
+            }
+        }
+
+        localWorkers.reap(chrono::steady_clock::now());
+    }
+}
+
+void broker::supervise(steady_time_t now)
+{
+    supervisor_load_t load = {queuedMessages(), 0, 0, 0};
+    vector<string>    retire;
+
+    if (starvedSince != steady_time_t())
+    {
+        load.waitMs = chrono::duration_cast<chrono::milliseconds>(now - starvedSince).count();
+    }
+
+    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+    {
+        if (!(*it).peer && (*it).credit > 0)
+        {
+            load.inFlight += (*it).outstanding;
+            load.credit += (*it).credit;
+        }
+    }
+
+    localWorkers.update(now, load, retire);
+
+    // a registered worker is drained like admin.drain does it and exits on shutdown
+    for (vector<string>::iterator it = retire.begin(); it < retire.end(); it++)
+    {
+        worker_t *worker = findWorker(*it);
+
+        if (worker != NULL)
+        {
+            drainWorker(*worker);
+        }
+        else
+        {
+            localWorkers.terminate(*it, now);
+        }
+    }
+}
+
+void broker::updateGauges()
+{
+    size_t active = 0;
+
+    for (unordered_map<string, stream_t>::iterator it = streams.begin(); it != streams.end(); it++)
+    {
+        active += it->second.finished || it->second.worker.empty() ? 0 : 1;
+    }
+
+    (*streamsActive) = active;
+    (*dedupMemory) = dedup.memoryBytes();
+    (*dedupFalsePositives) = llround(dedup.falsePositiveRate() * 1000000);
+
+    compression_stats_t compression = compressing.statistics();
+
+    (*compressionPayloads) = compression.compressed;
+    (*compressionSkipped) = compression.skipped;
+    (*compressionBytesIn) = compression.bytesIn;
+    (*compressionBytesOut) = compression.bytesOut;
+    (*compressionRatio) = compression.bytesIn > 0 ? llround((double) compression.bytesOut * 1000000 / compression.bytesIn) : 0;
+    (*compressionCpu) = compression.cpuUs;
+    (*compressionPending) = compressing.pending();
+}
+
+void broker::logStats()
+{
+    updateGauges();
+
+    LOG << "[stats] " << stats.format();
+}
+
+void broker::dispatchService()
+{
+    int    counter   = 0;
+    int    more      = 0;
+    size_t more_size = sizeof(more);
+
+    do
+    {
+        // [issuer][delimiter][request], anything after it is read and dropped
+        service->recv(counter < 3 ? &serviceFrames[counter] : &serviceExtra);
+        service->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+        counter++;
+    }
+    while (more);
+
+    if (counter != 3)
+    {
+        ERR << "Wrong messages count: " << counter;
+
+        return;
+    }
+
+    slice_t issuer  = sliceOf(serviceFrames[0]);
+    slice_t request = sliceOf(serviceFrames[2]);
+    slice_t action;
+
+    if (!findJsonValue(request, "action", action))
+    {
+        action.size = 0;
+    }
+
+    switch (internAction(action))
+    {
+        case ACTION_REGISTER:
+            registerWorker(toString(issuer), request);
+            break;
+
+        case ACTION_DONE:
+            workerDone(issuer, jsonUInt(request, "count", 1));
+            break;
+
+        case ACTION_SHUTDOWN:
+            removeWorker(toString(issuer));
+            sendToWorker(toString(issuer), "shutdown");
+            break;
+
+        case ACTION_PONG:
+            workerPong(issuer);
+            break;
+
+        case ACTION_QUIT:
+            interrupted = true;
+            break;
+
+        case ACTION_ADMIN_STATUS:
+            replyService(issuer, adminStatus());
+            break;
+
+        case ACTION_ADMIN_DRAIN:
+        case ACTION_ADMIN_QUARANTINE:
+        case ACTION_ADMIN_RELEASE:
+            replyService(issuer, adminWorker(internAction(action), request));
+            break;
+
+        default:
+            ERR << "Unknown service action: " << toString(action);
+    }
+}
+
+void broker::replyService(const slice_t &issuer, const string &data)
+{
+    zmq::message_t identity(issuer.size);
+    zmq::message_t delimiter(0);
+    zmq::message_t reply(data.size());
+
+    memcpy(identity.data(), issuer.data, issuer.size);
+    memcpy(reply.data(), data.data(), data.size());
+
+    // a tool that gave up waiting is not connected any more, the reply is dropped then
+    service->send(identity, ZMQ_SNDMORE);
+    service->send(delimiter, ZMQ_SNDMORE);
+    service->send(reply);
+}
+
+string broker::adminStatus()
+{
+    stringstream status;
+    size_t       batched = 0;
+
+    for (unordered_map<string, batch_t>::iterator it = batches.begin(); it != batches.end(); it++)
+    {
+        batched += it->second.messages.size();
+    }
+
+    updateGauges();
+
+    status << "{\"scheduler\":\"" << (scheduler == SCHEDULER_P2C ? "p2c" : "round_robin") << "\""
+           << ",\"next_worker\":" << (workers.empty() ? 0 : currentWorkerIndex % workers.size())
+           << ",\"draining\":" << (draining ? "true" : "false")
+           << ",\"holding\":" << (holding ? "true" : "false")
+           << ",\"outputs\":[";
+
+    for (size_t i = 0; i < outputDSNs.size(); i++)
+    {
+        status << (i == 0 ? "" : ",");
+
+        writeJsonString(status, outputDSNs[i]);
+    }
+
+    status << "]"
+           << ",\"queues\":{\"fair\":" << fair.size() << ",\"delayed\":" << delayed.size()
+           << ",\"due\":" << due.size() << ",\"stream_chunks\":" << streamChunks << ",\"batched\":" << batched
+           << ",\"foreign\":" << foreign.size() << ",\"in_flight\":" << inFlightMessages() << "}"
+           << ",\"workers\":[";
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        worker_t &worker = workers[i];
+
+        const char *state = worker.probeUntil != steady_time_t() ? "probing"
+                          : worker.retiring ? "draining" : worker.quarantined ? "quarantined" : "ready";
+
+        status << (i == 0 ? "\n" : ",\n") << "{\"name\":";
+
+        writeJsonString(status, worker.name);
+
+        status << ",\"state\":\"" << state << "\",\"transport\":\"" << transportNames[worker.transport] << "\""
+               << ",\"peer\":" << (worker.peer ? "true" : "false")
+               << ",\"batch\":" << (worker.batch ? "true" : "false")
+               << ",\"streams\":" << (worker.streams ? "true" : "false")
+               << ",\"shm\":" << (worker.ring ? "true" : "false")
+               << ",\"compression\":\"" << codecName(worker.codec) << "\""
+               << ",\"credit\":" << worker.credit << ",\"outstanding\":" << worker.outstanding
+               << ",\"in_flight\":" << worker.inFlight->size() << ",\"sent\":" << worker.sent
+               << ",\"rtt_us\":" << llround(worker.latency) << ",\"load\":" << worker.load << "}";
+    }
+
+    status << "],\n\"counters\":{";
+
+    vector<pair<string, uint64_t> > counters = stats.snapshot();
+
+    for (vector<pair<string, uint64_t> >::iterator it = counters.begin(); it < counters.end(); it++)
+    {
+        status << (it == counters.begin() ? "" : ",") << "\"" << (*it).first << "\":" << (*it).second;
+    }
+
+    status << "}}";
+
+    return status.str();
+}
+
+string broker::adminWorker(service_action_t action, const slice_t &request)
+{
+    slice_t id;
+
+    if (!findJsonValue(request, "worker", id))
+    {
+        return "{\"error\":\"worker missing\"}";
+    }
+
+    string    name   = toString(id);
+    worker_t *worker = findWorker(name);
+
+    if (worker == NULL)
+    {
+        return "{\"error\":\"unknown worker\"}";
+    }
+
+    if (action == ACTION_ADMIN_QUARANTINE)
+    {
+        worker->quarantined = true;
+
+        LOG << "Worker quarantined: " << name;
+    }
+    else if (action == ACTION_ADMIN_RELEASE)
+    {
+        worker->quarantined = false;
+        worker->retiring = false;
+
+        LOG << "Worker released: " << name;
+    }
+    else if (drainWorker(*worker))
+    {
+        return "{\"ok\":true,\"in_flight\":0}";
+    }
+
+    stringstream reply;
+
+    reply << "{\"ok\":true,\"in_flight\":" << (worker->credit > 0 ? worker->outstanding : 0) << "}";
+
+    return reply.str();
+}
+
+bool broker::drainWorker(worker_t &worker)
+{
+    // nothing to wait for, workers without credit never say what they have finished
+    if (worker.credit == 0 || worker.outstanding == 0)
+    {
+        string name = worker.name;
+
+        retireWorker(name);
+
+        return true;
+    }
+
+    worker.retiring = true;
+
+    LOG << "Worker draining: " << worker.name << ", " << worker.outstanding << " messages in flight";
+
+    return false;
+}
+
+void broker::retireWorker(const string &id)
+{
+    LOG << "Worker drained: " << id;
+
+    sendToWorker(id, "shutdown");
+    removeWorker(id);
+}
+
+broker::broker()
+    : ackInput(NULL), fairInput(NULL), broadcastInput(NULL),
+      inputDSN("tcp://127.0.0.1:8100"), outputDSNs(1, "tcp://127.0.0.1:8101"), serviceDSN("tcp://127.0.0.1:8102"),
+      currentWorkerIndex(0), scheduler(SCHEDULER_ROUND_ROBIN), rng(chrono::steady_clock::now().time_since_epoch().count()),
+      connected(false), interrupted(false), holding(false), waitingForWorkers(false),
+      pollItemsChanged(false), ackIndex(0), fairIndex(0), broadcastIndex(0), peersIndex(0),
+      heartbeatInterval(WORKER_HB_INTERVAL), heartbeatTimeout(WORKER_HB_TIMEOUT), draining(false), drainTimeout(SHUTDOWN_DRAIN_TIMEOUT),
+      batchSize(0), batchDelay(1000), streamChunks(0), streamWindow(16), streamIdleTimeout(60),
+      compressionThreads(0), compressionThreshold(4096), federationCredit(100), snapshotDirty(false)
+{
+    char host[256] = {0};
+
+    gethostname(host, sizeof(host) - 1);
+
+    hostName = host;
+
+    wakeup[0] = wakeup[1] = -1;
+
+    string chunk = controlMessage("chunk");
+
+    chunkFrame.rebuild(chunk.size());
+    memcpy(chunkFrame.data(), chunk.data(), chunk.size());
+
+    for (int codec = CODEC_NONE + 1; codec < CODEC_COUNT; codec++)
+    {
+        string marker = codecMarker((codec_t) codec);
+
+        codecFrames[codec].rebuild(marker.size());
+        memcpy(codecFrames[codec].data(), marker.data(), marker.size());
+    }
+
+    inputReceived  = &stats.counter("input.received");
+    inputShed      = &stats.counter("input.shed");
+    inputThrottled = &stats.counter("input.throttled");
+
+    outputBatches         = &stats.counter("output.batches");
+    outputBatchedMessages = &stats.counter("output.batched_messages");
+
+    outputFailed       = &stats.counter("output.failed");
+    outputRedispatched = &stats.counter("output.redispatched");
+    outputOrphaned     = &stats.counter("output.orphaned");
+
+    deadLettersWritten = &stats.counter("dead_letters.written");
+    deadLettersFailed  = &stats.counter("dead_letters.failed");
+
+    delayedScheduled = &stats.counter("delayed.scheduled");
+    delayedReleased  = &stats.counter("delayed.released");
+    delayedPending   = &stats.counter("delayed.pending");
+    delayedLag       = &stats.counter("delayed.lag_us");
+
+    streamsStarted   = &stats.counter("streams.started");
+    streamsActive    = &stats.counter("streams.active");
+    streamsBroken    = &stats.counter("streams.broken");
+    streamChunksSent = &stats.counter("streams.chunks");
+
+    dedupDropped        = &stats.counter("dedup.dropped");
+    dedupMemory         = &stats.counter("dedup.memory_bytes");
+    dedupFalsePositives = &stats.counter("dedup.fp_ppm");
+
+    outputShared     = &stats.counter("output.shared");
+    outputSharedFull = &stats.counter("output.shared_full");
+
+    broadcastReceived = &stats.counter("broadcast.received");
+    broadcastSent     = &stats.counter("broadcast.sent");
+
+    federationForwarded = &stats.counter("federation.forwarded");
+    federationReceived  = &stats.counter("federation.received");
+
+    compressionPayloads  = &stats.counter("compression.payloads");
+    compressionSkipped   = &stats.counter("compression.skipped");
+    compressionQueueFull = &stats.counter("compression.queue_full");
+    compressionBytesIn   = &stats.counter("compression.bytes_in");
+    compressionBytesOut  = &stats.counter("compression.bytes_out");
+    compressionRatio     = &stats.counter("compression.ratio_ppm");
+    compressionCpu       = &stats.counter("compression.cpu_us");
+    compressionPending   = &stats.counter("compression.pending");
+}
+
+void broker::connect()
+{
+    if (connected)
+    {
+        return;
+    }
+
+    ctx = new zmq::context_t();
+
+    input = new zmq::socket_t(*ctx, ZMQ_PULL);
+    input->bind(inputDSN.c_str());
+
+    int mandatory = 1;
+
+    // sends to a gone or saturated worker fail instead of being dropped silently, see sendIdentity()
+    output = new zmq::socket_t(*ctx, ZMQ_ROUTER);
+    output->setsockopt(ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory));
+
+    for (vector<string>::iterator it = outputDSNs.begin(); it < outputDSNs.end(); it++)
+    {
+        output->bind((*it).c_str());
+    }
+
+    service = new zmq::socket_t(*ctx, ZMQ_ROUTER);
+    service->bind(serviceDSN.c_str());
+
+    openInput(ackInput, ZMQ_ROUTER, ackInputDSN, "", "ack input");
+    openInput(fairInput, ZMQ_ROUTER, fairInputDSN, "", "fair input");
+    openInput(broadcastInput, ZMQ_PULL, broadcastInputDSN, "", "broadcast input");
+
+    LOG << "Listen:   input on " << inputDSN;
+    for (vector<string>::iterator it = outputDSNs.begin(); it < outputDSNs.end(); it++)
+    {
+        LOG << "Listen:  output on " << *it;
+    }
+    LOG << "Listen: service on " << serviceDSN;
+
+    connected = true;
+}
+
+bool broker::receiveInput(zmq::socket_t &socket, bool acknowledged, input_message_t &message)
+{
+    int    more      = 0;
+    size_t more_size = sizeof(more);
+
+    message.acknowledged = acknowledged;
+    message.fair = false;
+    message.admitted = false;
+    message.throttled = false;
+
+    if (acknowledged)
+    {
+        zmq::message_t seq;
+
+        socket.recv(&message.identity);
+        socket.recv(&seq);
+        socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+        if (!more || seq.size() != SEQ_SIZE)
+        {
+            ERR << "Wrong acknowledged input message";
+
+            while (more)
+            {
+                socket.recv(&seq);
+                socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+            }
+
+            return false;
+        }
+
+        message.producer.assign(static_cast<const char *>(message.identity.data()), message.identity.size());
+        message.seq = decodeSeq(seq.data());
+
+        acks.received(socket, message.producer, message.seq, chrono::steady_clock::now());
+    }
+
+    socket.recv(&message.payload);
+    socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+    message.deliverAt = steady_time_t();
+    message.keyed = false;
+    message.stream.clear();
+
+    // [header][payload] is delayed and deduplicated as the header says, frames after the payload are dropped
+    if (more)
+    {
+        message.deliverAt = deliveryTime(message.payload, chrono::steady_clock::now());
+        message.keyed = dedup.enabled() && idempotencyKey(message.payload, message.key);
+
+        slice_t stream;
+
+        if (findJsonValue(sliceOf(message.payload), "stream", stream) && stream.size > 0)
+        {
+            message.stream.assign(stream.data, stream.size);
+            message.lastChunk = jsonBool(sliceOf(message.payload), "last", false);
+            message.header.move(&message.payload);
+        }
+
+        socket.recv(&message.payload);
+        socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+        while (more)
+        {
+            zmq::message_t extra;
+
+            socket.recv(&extra);
+            socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+        }
+    }
+
+    message.trace = trace.sample();
+
+    if (message.trace != 0)
+    {
+        trace.record(message.trace, TRACE_RECEIVED);
+    }
+
+    return true;
+}
+
+void broker::receiveInputs(zmq::socket_t &socket, bool acknowledged, steady_time_t now)
+{
+    for (int i = 0; i < POLL_BURST && !holding && (i == 0 || readable(socket)); i++)
+    {
+        if (!receiveInput(socket, acknowledged, held))
+        {
+            continue;
+        }
+
+        (*inputReceived)++;
+
+        if (held.keyed && dedup.contains(held.key, now))
+        {
+            (*dedupDropped)++;
+
+            // the producer sent it again because it missed the ack, so it is acknowledged once more
+            if (held.acknowledged)
+            {
+                acks.accepted(socket, held.producer, held.seq, now);
+            }
+
+            continue;
+        }
+
+        holding = !dispatchInput(held, now);
+    }
+}
+
+void broker::receiveFair()
+{
+    int    more      = 0;
+    size_t more_size = sizeof(more);
+
+    for (int i = 0; i < POLL_BURST && !fair.full() && (i == 0 || readable(*fairInput)); i++)
+    {
+        // [identity][tenant][payload], or [identity][payload] to group by connection
+        zmq::message_t identity;
+        zmq::message_t tenant;
+        zmq::message_t payload;
+
+        fairInput->recv(&identity);
+        fairInput->recv(&tenant);
+        fairInput->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+        if (more)
+        {
+            fairInput->recv(&payload);
+            fairInput->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+        }
+        else
+        {
+            payload.move(&tenant);
+        }
+
+        if (more)
+        {
+            ERR << "Wrong fair input message";
+
+            while (more)
+            {
+                fairInput->recv(&payload);
+                fairInput->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+            }
+
+            continue;
+        }
+
+        (*inputReceived)++;
+
+        uint32_t traceId = trace.sample();
+
+        if (traceId != 0)
+        {
+            trace.record(traceId, TRACE_RECEIVED);
+        }
+
+        // a tenant that filled its queue loses the message, the others are not held up by it
+        if (!fair.push(toString(sliceOf(tenant.size() > 0 ? tenant : identity)), payload, traceId))
+        {
+            (*inputShed)++;
+        }
+    }
+}
+
+void broker::receiveBroadcasts()
+{
+    for (int i = 0; i < POLL_BURST && (i == 0 || readable(*broadcastInput)); i++)
+    {
+        zmq::message_t payload;
+
+        broadcastInput->recv(&payload);
+
+        (*broadcastReceived)++;
+
+        // every local worker gets a copy sharing the payload, peers are left out as they would pass it
+        // to one of their workers only; credit is not waited for but counted, since workers report done
+        for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+        {
+            worker_t &worker = *it;
+
+            if (worker.peer || !eligible(worker))
+            {
+                continue;
+            }
+
+            zmq::message_t copy;
+            copy.copy(&payload);
+
+            takeWorker(worker);
+            deliver(worker, copy, 0, false);
+
+            (*broadcastSent)++;
+        }
+    }
+}
+
+void broker::dispatchFair(steady_time_t now)
+{
+    // one message at a time through held, so rate limits and worker credit apply as to the other inputs
+    while (!holding && !fair.empty())
+    {
+        held.acknowledged = false;
+        held.fair = true;
+        held.admitted = false;
+        held.throttled = false;
+        held.deliverAt = steady_time_t();
+        held.keyed = false;
+        held.stream.clear();
+
+        fair.pop(held.producer, held.payload, held.trace);
+
+        holding = !dispatchInput(held, now);
+    }
+}
+
+void broker::schedule(input_message_t &message, steady_time_t now)
+{
+    delayed.push(milliseconds(now), milliseconds(message.deliverAt), message.payload, message.trace);
+
+    (*delayedScheduled)++;
+    (*delayedPending) = delayed.size() + due.size();
+
+    // the broker holds it from now on, the producer does not wait until it is delivered
+    accepted(message, now);
+}
+
+void broker::dispatchDelayed(steady_time_t now)
+{
+    if (delayed.size() > 0)
+    {
+        size_t released = due.size();
+
+        delayed.advance(milliseconds(now), due);
+
+        for (deque<delayed_message_t>::iterator it = due.begin() + released; it != due.end(); it++)
+        {
+            (*delayedLag) += chrono::duration_cast<chrono::microseconds>(now - steady_time_t(chrono::milliseconds((*it).due))).count();
+        }
+
+        (*delayedReleased) += due.size() - released;
+    }
+
+    // admitted when they arrived, they only wait for a worker now
+    while (!holding && !due.empty())
+    {
+        held.acknowledged = false;
+        held.fair = false;
+        held.admitted = true;
+        held.throttled = false;
+        held.deliverAt = steady_time_t();
+        held.keyed = false;
+        held.stream.clear();
+        held.trace = due.front().trace;
+
+        held.payload.move(&due.front().payload);
+
+        due.pop_front();
+
+        holding = !dispatchInput(held, now);
+    }
+
+    (*delayedPending) = delayed.size() + due.size();
+}
+
+bool broker::redispatch(const string &from, zmq::message_t &payload, uint32_t traceId)
+{
+    bool other = false;
+
+    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end() && !other; it++)
+    {
+        other = (*it).name != from && eligible(*it);
+    }
+
+    // with nobody else to take it the message would only wait for the gone worker to come back
+    if (!other)
+    {
+        return false;
+    }
+
+    outgoing_message_t message = {move(payload), traceId};
+
+    unsent.push_back(move(message));
+
+    (*outputRedispatched)++;
+
+    return true;
+}
+
+void broker::dispatchUnsent(steady_time_t now)
+{
+    // accepted when they were first dispatched, they only wait for a worker now
+    while (!holding && !unsent.empty())
+    {
+        held.acknowledged = false;
+        held.fair = false;
+        held.admitted = true;
+        held.throttled = false;
+        held.deliverAt = steady_time_t();
+        held.keyed = false;
+        held.stream.clear();
+        held.trace = unsent.front().trace;
+
+        held.payload.move(&unsent.front().payload);
+
+        unsent.pop_front();
+
+        holding = !dispatchInput(held, now);
+    }
+}
+
+bool broker::dispatchInput(input_message_t &message, steady_time_t now)
+{
+    // false leaves the message held until the rate limiter admits it or a worker gets spare credit
+    if (!message.admitted && limiter.enabled())
+    {
+        switch (admitInput(message, now))
+        {
+            case ADMIT_SHED:
+                // ack input could be closed by a reload meanwhile
+                if (message.acknowledged && ackInput != NULL)
+                {
+                    acks.rejected(*ackInput, message.producer, message.seq);
+                }
+
+                return true;
+
+            case ADMIT_THROTTLED:
+                return false;
+
+            default:
+                break;
+        }
+    }
+
+    if (message.trace != 0 && message.throttled && !message.admitted)
+    {
+        trace.record(message.trace, TRACE_ADMITTED);
+    }
+
+    // remembered only once accepted, a shed message may be sent again with the same key
+    if (message.keyed && !message.admitted)
+    {
+        dedup.insert(message.key, now);
+    }
+
+    message.admitted = true;
+
+    // chunks are never delayed, they would be out of order with the rest of their stream
+    if (!message.stream.empty())
+    {
+        return dispatchChunk(message, now);
+    }
+
+    if (message.deliverAt > now)
+    {
+        schedule(message, now);
+
+        return true;
+    }
+
+    worker_t *worker = selectWorker(true);
+
+    if (worker == NULL)
+    {
+        if (starvedSince == steady_time_t())
+        {
+            starvedSince = now;
+        }
+
+        if (!waitingForWorkers && workers.size() == 0)
+        {
+            LOG << "wait for workers";
+
+            waitingForWorkers = true;
+        }
+
+        return false;
+    }
+
+    if (waitingForWorkers)
+    {
+        LOG << "wait for workers: done";
+
+        waitingForWorkers = false;
+    }
+
+    if (message.trace != 0)
+    {
+        trace.record(message.trace, TRACE_SELECTED, &worker->name);
+    }
+
+    deliver(*worker, message.payload, message.trace, true);
+
+    accepted(message, now);
+
+    return true;
+}
+
+void broker::accepted(input_message_t &message, steady_time_t now)
+{
+    // ack input could be closed by a reload meanwhile
+    if (message.acknowledged && ackInput != NULL)
+    {
+        acks.accepted(*ackInput, message.producer, message.seq, now);
+
+        if (message.trace != 0)
+        {
+            trace.record(message.trace, TRACE_ACKED);
+        }
+    }
+}
+
+bool broker::dispatchChunk(input_message_t &message, steady_time_t now)
+{
+    unordered_map<string, stream_t>::iterator it = streams.find(message.stream);
+
+    if (it == streams.end())
+    {
+        // the first chunk picks the worker, the rest of the stream follows it
+        worker_t *worker = selectWorker(false, true);
+
+        if (worker == NULL && takesStreams())
+        {
+            return false;
+        }
+
+        it = streams.insert(make_pair(message.stream, stream_t())).first;
+
+        it->second.finished = false;
+        it->second.refused = worker == NULL;
+
+        if (worker == NULL)
+        {
+            // holding the chunk would stall the input until such a worker registers, the stream is kept with no
+            // worker so none of its chunks starts it later in the middle
+            ERR << "Stream refused, no worker takes streams: " << message.stream;
+
+            deadLetter("", message.payload, DEAD_SEND_FAILED);
+        }
+        else
+        {
+            it->second.worker = worker->name;
+
+            (*streamsStarted)++;
+
+            sendChunk(*worker, message.header, message.payload, message.trace);
+        }
+    }
+    else if (it->second.worker.empty() || findWorker(it->second.worker) == NULL)
+    {
+        // the worker holding the beginning is gone, the stream cannot be put together anywhere else
+        if (!it->second.worker.empty())
+        {
+            breakStreams(it->second.worker);
+        }
+
+        deadLetter("", message.payload, it->second.refused ? DEAD_SEND_FAILED : DEAD_WORKER_LOST);
+    }
+    else
+    {
+        stream_t &stream = it->second;
+        worker_t *worker = findWorker(stream.worker);
+
+        if (stream.pending.empty() && ready(*worker))
+        {
+            takeWorker(*worker);
+
+            sendChunk(*worker, message.header, message.payload, message.trace);
+        }
+        else if (stream.pending.size() < streamWindow)
+        {
+            stream_chunk_t chunk = {move(message.header), move(message.payload), message.trace};
+
+            stream.pending.push_back(move(chunk));
+
+            streamChunks++;
+        }
+        else
+        {
+            // window is full, input waits for the worker like for any other
+            return false;
+        }
+    }
+
+    // a finished stream stays until the idle timeout, so chunks sent again late still follow it
+    it->second.updated = now;
+    it->second.finished = it->second.finished || message.lastChunk;
+
+    accepted(message, now);
+
+    return true;
+}
+
+bool broker::takesStreams()
+{
+    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+    {
+        if ((*it).streams && !(*it).peer)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void broker::dispatchStreams()
+{
+    if (streamChunks == 0)
+    {
+        return;
+    }
+
+    for (unordered_map<string, stream_t>::iterator it = streams.begin(); it != streams.end(); it++)
+    {
+        stream_t &stream = it->second;
+        worker_t *worker = stream.pending.empty() ? NULL : findWorker(stream.worker);
+
+        if (!stream.pending.empty() && worker == NULL)
+        {
+            breakStreams(stream.worker);
+
+            continue;
+        }
+
+        while (worker != NULL && !stream.pending.empty() && ready(*worker))
+        {
+            takeWorker(*worker);
+
+            sendChunk(*worker, stream.pending.front().header, stream.pending.front().payload, stream.pending.front().trace);
+
+            stream.pending.pop_front();
+
+            streamChunks--;
+        }
+    }
+}
+
+void broker::sendChunk(worker_t &worker, zmq::message_t &header, zmq::message_t &payload, uint32_t traceId)
+{
+    // [chunk marker][header][payload] tells chunks from batches, workers get it only when they asked for streams
+    if (!sendIdentity(worker))
+    {
+        (*outputFailed)++;
+
+        worker.outstanding = worker.outstanding > 0 ? worker.outstanding - 1 : 0;
+
+        deadLetter(worker.name, payload, DEAD_SEND_FAILED);
+
+        return;
+    }
+
+    send(chunkFrame, true);
+    send(header, true);
+    send(payload);
+
+    (*streamChunksSent)++;
+
+    // chunks always take the socket, later payloads must not overtake them through the ring
+    if (worker.ring)
+    {
+        worker.socketBacklog = worker.outstanding;
+    }
+
+    if (traceId != 0)
+    {
+        trace.record(traceId, TRACE_SENT, &worker.name);
+    }
+
+    if (worker.credit > 0)
+    {
+        outgoing_message_t sent = {move(payload), traceId};
+
+        worker.inFlight->push_back(move(sent));
+    }
+}
+
+void broker::breakStreams(string worker)
+{
+    for (unordered_map<string, stream_t>::iterator it = streams.begin(); it != streams.end(); it++)
+    {
+        stream_t &stream = it->second;
+
+        if (stream.worker != worker)
+        {
+            continue;
+        }
+
+        // a finished one had all its chunks sent, only late copies of them are dead lettered from now on
+        if (!stream.finished || !stream.pending.empty())
+        {
+            ERR << "Stream broken, worker lost: " << it->first;
+
+            (*streamsBroken)++;
+        }
+
+        for (deque<stream_chunk_t>::iterator chunk = stream.pending.begin(); chunk != stream.pending.end(); chunk++)
+        {
+            deadLetter(worker, (*chunk).payload, DEAD_WORKER_LOST);
+        }
+
+        streamChunks -= stream.pending.size();
+
+        stream.pending.clear();
+        stream.worker.clear();
+    }
+}
+
+void broker::sweepStreams(steady_time_t now)
+{
+    // finished streams are forgotten once late chunks are unlikely, unfinished ones were abandoned by the producer
+    for (unordered_map<string, stream_t>::iterator it = streams.begin(); it != streams.end();)
+    {
+        if (it->second.pending.empty() && it->second.updated + streamIdleTimeout <= now)
+        {
+            if (!it->second.finished && !it->second.refused)
+            {
+                ERR << "Stream abandoned: " << it->first;
+            }
+
+            it = streams.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+void broker::deliver(worker_t &worker, zmq::message_t &payload, uint32_t traceId, bool input)
+{
+    // same host workers get the payload through their shared memory ring, the socket is used when it is full;
+    // the worker reads the ring first, so it stays on the socket until what went that way is done
+    if (worker.ring && worker.socketBacklog == 0)
+    {
+        if (worker.ring->push(payload.data(), payload.size()))
+        {
+            (*outputShared)++;
+
+            if (traceId != 0)
+            {
+                trace.record(traceId, TRACE_SENT, &worker.name);
+            }
+
+            if (worker.credit > 0)
+            {
+                outgoing_message_t sent = {move(payload), traceId};
+
+                worker.inFlight->push_back(move(sent));
+            }
+
+            return;
+        }
+
+        (*outputSharedFull)++;
+    }
+
+    if (worker.ring)
+    {
+        worker.socketBacklog = worker.outstanding;
+    }
+
+    // large payloads for workers on other hosts are compressed off the poll loop and sent by sendCompressed(),
+    // anything else for the worker meanwhile goes through the compressor as well to keep its place
+    bool large    = worker.codec != CODEC_NONE && payload.size() >= compressionThreshold;
+    bool compress = large && compressing.pending() < COMPRESSION_QUEUE_MAX;
+
+    if (large && !compress)
+    {
+        (*compressionQueueFull)++;
+    }
+
+    if (compress || worker.compressions > 0)
+    {
+        unordered_map<string, batch_t>::iterator batch = batches.find(worker.name);
+
+        // batched payloads came first, they go out before
+        if (batch != batches.end() && !batch->second.messages.empty())
+        {
+            flushBatch(worker.name, batch->second);
+        }
+
+        compression_job_t job;
+
+        job.worker = worker.name;
+        job.codec = worker.codec;
+        job.payload = move(payload);
+        job.trace = traceId;
+        job.compress = compress;
+        job.input = input;
+
+        compressing.submit(job);
+
+        worker.compressions++;
+
+        return;
+    }
+
+    if (input && worker.batch && batchSize > 1)
+    {
+        enqueueBatch(worker.name, payload, traceId);
+
+        return;
+    }
+
+    transmit(worker, payload, traceId, input, CODEC_NONE, NULL);
+}
+
+void broker::transmit(worker_t &worker, zmq::message_t &payload, uint32_t traceId, bool input, codec_t codec,
+                      const zmq::message_t *compressed)
+{
+    if (!sendIdentity(worker))
+    {
+        // it never reaches the worker, so no done will come for it
+        worker.outstanding = worker.outstanding > 0 ? worker.outstanding - 1 : 0;
+
+        // a full queue is the worker's, a gone worker's message is not lost with it
+        if (input && disconnected(worker) && redispatch(worker.name, payload, traceId))
+        {
+            return;
+        }
+
+        (*outputFailed)++;
+
+        deadLetter(worker.name, payload, DEAD_SEND_FAILED);
+
+        return;
+    }
+
+    if (compressed != NULL)
+    {
+        send(codecFrames[codec], true);
+        send(*compressed);
+    }
+    else
+    {
+        send(payload);
+    }
+
+    if (traceId != 0)
+    {
+        trace.record(traceId, TRACE_SENT, &worker.name);
+    }
+
+    // send() copied the payload, the original is kept until the worker reports it done
+    if (worker.credit > 0)
+    {
+        outgoing_message_t sent = {move(payload), traceId};
+
+        worker.inFlight->push_back(move(sent));
+    }
+}
+
+void broker::sendCompressed()
+{
+    deque<compression_job_t> done;
+
+    compressing.collect(done);
+
+    for (deque<compression_job_t>::iterator it = done.begin(); it != done.end(); it++)
+    {
+        compression_job_t &job    = *it;
+        worker_t          *worker = findWorker(job.worker);
+
+        // unregistered while the payload was compressed, it was not sent yet
+        if (worker == NULL && job.input && redispatch(job.worker, job.payload, job.trace))
+        {
+            continue;
+        }
+
+        if (worker == NULL)
+        {
+            (*outputOrphaned)++;
+
+            if (job.trace != 0)
+            {
+                trace.record(job.trace, TRACE_LOST, &job.worker);
+            }
+
+            deadLetter(job.worker, job.payload, DEAD_WORKER_LOST);
+
+            continue;
+        }
+
+        worker->compressions = worker->compressions > 0 ? worker->compressions - 1 : 0;
+
+        transmit(*worker, job.payload, job.trace, job.input, job.codec, job.compressed.size() > 0 ? &job.compressed : NULL);
+    }
+}
+
+void broker::deadLetter(const string &worker, const zmq::message_t &payload, dead_reason_t reason)
+{
+    if (deadLetters.append(worker, payload, reason))
+    {
+        (*deadLettersWritten)++;
+    }
+    else if (!deadLetters.getDirectory().empty())
+    {
+        // configured but failing, e.g. the disk is full or a new segment could not be started
+        (*deadLettersFailed)++;
+    }
+}
+
+admission_t broker::admitInput(input_message_t &message, steady_time_t now)
+{
+    const char *producer = NULL;
+    size_t      size     = 0;
+
+    if (limiter.perProducer() && (message.acknowledged || message.fair))
+    {
+        producer = message.producer.data();
+        size = message.producer.size();
+    }
+    else if (limiter.perProducer())
+    {
+        // plain input has no identity, producers are told apart by peer address (tcp only)
+        producer = message.payload.gets("Peer-Address");
+        size = producer != NULL ? strlen(producer) : 0;
+    }
+
+    if (limiter.admit(producer, size, now))
+    {
+        return ADMIT_ACCEPTED;
+    }
+
+    // acknowledged producers are told to retry instead of being blocked
+    if (limiter.getPolicy() == OVERFLOW_SHED || message.acknowledged)
+    {
+        (*inputShed)++;
+
+        return ADMIT_SHED;
+    }
+
+    if (!message.throttled)
+    {
+        (*inputThrottled)++;
+
+        message.throttled = true;
+    }
+
+    holdUntil = now + limiter.wait(producer, size, now);
+
+    return ADMIT_THROTTLED;
+}
+
+void broker::registerWorker(const string &id, const slice_t &request)
+{
+    bool peer = jsonBool(request, "peer", false);
+
+    if (peer && id == "federation:" + federationName)
+    {
+        ERR << "Refused to federate with self: " << id;
+
+        return;
+    }
+
+    if (peer && jsonUInt(request, "credit", 0) == 0)
+    {
+        ERR << "Peer must announce credit: " << id;
+
+        return;
+    }
+
+    bool                                    found    = false;
+    unordered_map<string, size_t>::iterator existing = workerIndex.find(id);
+
+    if (existing != workerIndex.end())
+    {
+        // a restored worker registering again is confirmed with what it announces now
+        if (workers[existing->second].probeUntil != steady_time_t())
+        {
+            eraseWorker(existing->second);
+        }
+        else
+        {
+            found = true;
+
+            ERR << "Worker already registered: " << id;
+        }
+    }
+
+    if (!found)
+    {
+        worker_t wrk;
+
+        wrk.name = id;
+        wrk.identity.rebuild(id.size());
+        memcpy(wrk.identity.data(), id.data(), id.size());
+        wrk.registration = toString(request);
+        wrk.registered = chrono::steady_clock::now();
+        wrk.heartbeatSent = steady_time_t();
+        wrk.lastHeartbitRecieved = steady_time_t();
+        wrk.batch = jsonBool(request, "batch", false);
+        wrk.streams = jsonBool(request, "streams", false);
+        wrk.peer = peer;
+
+        slice_t endpoint;
+
+        wrk.transport = findJsonValue(request, "output", endpoint) ? transportOf(toString(endpoint), hostName) : TRANSPORT_NETWORK;
+
+        slice_t codecs;
+
+        // compression pays off only for the bandwidth between hosts
+        wrk.codec = wrk.transport == TRANSPORT_NETWORK && compressing.running() && findJsonValue(request, "compression", codecs)
+                  ? negotiateCodec(codecs) : CODEC_NONE;
+        wrk.compressions = 0;
+        wrk.credit = jsonUInt(request, "credit", 0);
+        wrk.outstanding = 0;
+        wrk.sent = 0;
+        wrk.latency = 0;
+        wrk.load = 0;
+        wrk.inFlight = make_shared<deque<outgoing_message_t> >();
+        wrk.probeUntil = steady_time_t();
+        wrk.quarantined = false;
+        wrk.retiring = false;
+        wrk.unreachable = false;
+        wrk.socketBacklog = 0;
+
+        slice_t shm;
+        slice_t host;
+
+        // a segment name is meaningful only on the host that created it
+        if (findJsonValue(request, "shm", shm) && findJsonValue(request, "host", host) && host == hostName)
+        {
+            wrk.ring.reset(shm_ring::open(toString(shm)));
+
+            if (!wrk.ring)
+            {
+                ERR << "Shared memory unavailable [" << id << "]: " << toString(shm) << ": " << strerror(errno);
+            }
+        }
+
+        workers.push_back(move(wrk));
+        workerIndex[id] = workers.size() - 1;
+
+        worker_t &added      = workers.back();
+        bool      supervised = localWorkers.registered(id);
+
+        LOG << (peer ? "Peer registered: " : "Worker registered: ") << id << (added.batch ? " [batch]" : "")
+            << (added.streams ? " [streams]" : "") << (added.ring ? " [shm]" : "")
+            << (added.codec != CODEC_NONE ? string(" [") + codecName(added.codec) + "]" : "") << (supervised ? " [supervised]" : "");
+
+        // first ping goes out right away
+        nextHeartbeat = chrono::steady_clock::now();
+
+        snapshotDirty = true;
+    }
+}
+
+void broker::restoreWorkers(steady_time_t now)
+{
+    vector<worker_snapshot_entry_t> entries;
+
+    if (!readWorkerSnapshot(snapshotPath, entries) && entries.empty())
+    {
+        return;
+    }
+
+    for (vector<worker_snapshot_entry_t>::iterator it = entries.begin(); it < entries.end(); it++)
+    {
+        registerWorker((*it).identity, sliceOf((*it).registration));
+
+        worker_t *worker = findWorker((*it).identity);
+
+        if (worker != NULL)
+        {
+            worker->probeUntil = now + heartbeatTimeout;
+        }
+    }
+
+    LOG << "Worker snapshot: " << workers.size() << " workers restored, waiting for their pongs";
+}
+
+void broker::saveWorkers()
+{
+    vector<worker_snapshot_entry_t> entries;
+
+    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+    {
+        worker_snapshot_entry_t entry = {(*it).name, (*it).registration};
+
+        entries.push_back(entry);
+    }
+
+    if (writeWorkerSnapshot(snapshotPath, entries))
+    {
+        snapshotDirty = false;
+    }
+}
+
+void broker::removeWorker(const string &id)
+{
+    unordered_map<string, size_t>::iterator found = workerIndex.find(id);
+
+    if (found != workerIndex.end())
+    {
+        deque<outgoing_message_t> &inFlight = *workers[found->second].inFlight;
+
+        if (!inFlight.empty())
+        {
+            ERR << "Worker lost " << inFlight.size() << " messages in flight: " << id;
+        }
+
+        for (deque<outgoing_message_t>::iterator message = inFlight.begin(); message != inFlight.end(); message++)
+        {
+            (*outputOrphaned)++;
+
+            if ((*message).trace != 0)
+            {
+                trace.record((*message).trace, TRACE_LOST, &id);
+            }
+
+            deadLetter(id, (*message).payload, DEAD_WORKER_LOST);
+        }
+
+        eraseWorker(found->second);
+
+        breakStreams(id);
+
+        snapshotDirty = true;
+    }
+
+    LOG << "Worker unregistered: " << id;
+}
+
+void broker::eraseWorker(size_t index)
+{
+    workerIndex.erase(workers[index].name);
+    workers.erase(workers.begin() + index);
+
+    // workers after it moved down by one
+    for (size_t i = index; i < workers.size(); i++)
+    {
+        workerIndex[workers[i].name] = i;
+    }
+}
+
+void broker::markUnreachable(const string &id)
+{
+    worker_t *worker = findWorker(id);
+
+    // a probed worker is expected to be unreachable until it connects again
+    if (worker == NULL || disconnected(*worker))
+    {
+        return;
+    }
+
+    steady_time_t now = chrono::steady_clock::now();
+
+    // output may connect later than service does, a worker that just registered is pinged until it is there
+    if (now < worker->registered + chrono::milliseconds(WORKER_CONNECT_MS))
+    {
+        worker->probeUntil = now + heartbeatTimeout;
+
+        nextHeartbeat = min(nextHeartbeat, now + chrono::milliseconds(WORKER_PROBE_INTERVAL_MS));
+
+        return;
+    }
+
+    // gets nothing more, callers may still hold a reference so it is removed by removeUnreachable()
+    worker->unreachable = true;
+
+    unreachable.push_back(id);
+}
+
+void broker::removeUnreachable()
+{
+    for (vector<string>::iterator it = unreachable.begin(); it < unreachable.end(); it++)
+    {
+        worker_t *worker = findWorker(*it);
+
+        if (worker != NULL && worker->unreachable)
+        {
+            ERR << "Worker unreachable: " << *it;
+
+            removeWorker(*it);
+        }
+    }
+
+    unreachable.clear();
+}
+
+void broker::send(const string &data)
+{
+    send(data, false);
+}
+
+bool broker::sendIdentity(const string &id)
+{
+    zmq::message_t identity(id.size());
+    memcpy(identity.data(), id.data(), id.size());
+
+    return sendIdentity(identity, id);
+}
+
+bool broker::sendIdentity(worker_t &worker)
+{
+    // the copy shares the worker's frame (or holds it inline when short), nothing is allocated per message
+    zmq::message_t identity;
+    identity.copy(&worker.identity);
+
+    return sendIdentity(identity, worker.name);
+}
+
+bool broker::sendIdentity(zmq::message_t &identity, const string &id)
+{
+    // with ROUTER_MANDATORY the identity frame fails when the worker is gone or its queue is full,
+    // nothing is sent then, so the caller must not send the rest of the message
+    try
+    {
+        return output->send(identity, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+    }
+    catch (zmq::error_t e)
+    {
+        if (e.num() == EHOSTUNREACH)
+        {
+            markUnreachable(id);
+        }
+        else
+        {
+            ERR << "Send faied [" << id << "]: error " << e.num() << ": " << e.what();
+        }
+
+        return false;
+    }
+}
+
+void broker::send(const string &data, bool more)
+{
+    zmq::message_t message(data.size());
+    memcpy(message.data(), data.data(), data.size());
+
+    if (more)
+    {
+        output->send(message, ZMQ_SNDMORE);
+    }
+    else
+    {
+        output->send(message);
+    }
+}
+
+void broker::send(const zmq::message_t &msg)
+{
+    send(msg, false);
+}
 
-            writeLock.unlock();
-        }
+void broker::send(const zmq::message_t &msg, bool more)
+{
+    int  flags = 0;
+    bool result;
 
-        if (interrupted)
-        {
-            break;
-        }
-    }
+    // shares the payload with msg instead of copying it, msg is kept for dead letters and replays
+    zmq::message_t message;
+    message.copy(const_cast<zmq::message_t *>(&msg));
 
-    serviceThread.join();
-    heartbeatThread.join();
+    if (more)
+    {
+        flags = ZMQ_SNDMORE;
+    }
 
-    LOG << "Main thread finished";
+    do
+    {
+        result = output->send(message, flags);
+    }
+    while (!result); // eagain workaround
 }
 
-void broker::dispatchService()
+worker_t *broker::selectWorker(bool allowPeers, bool streaming)
 {
-    BOOST_LOG_SCOPED_THREAD_TAG("ThreadID", boost::this_thread::get_id());
-
-    LOG << "Service dispatcher thread started";
+    size_t    count  = workers.size();
+    worker_t *sample = scheduler == SCHEDULER_P2C ? sampleWorker(streaming) : NULL;
 
-    zmq::pollitem_t pollItems[] = {{*service, 0, ZMQ_POLLIN, 0}};
+    if (sample != NULL)
+    {
+        return sample;
+    }
 
-    while (true)
+    for (int pass = 0; pass < (allowPeers ? 2 : 1); pass++)
     {
-        try
-        {
-            zmq_poll(pollItems, 1, 1000);
-        }
-        catch (zmq::error_t e)
-        {
-        }
+        // local workers first, peers only take the overflow
+        bool peers = pass > 0;
 
-        if (pollItems[0].revents & ZMQ_POLLIN)
+        for (size_t i = 0; i < count; i++)
         {
-            zmq::message_t items[3];
-            int            counter   = 0;
-            int            more      = 0;
-            size_t         more_size = sizeof(more);
+            size_t    index  = (currentWorkerIndex + i) % count;
+            worker_t &worker = workers[index];
 
-            do
+            if (worker.peer != peers || !ready(worker) || (streaming && !worker.streams))
             {
-                service->recv(&items[counter]);
-                service->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-
-                counter++;
+                continue;
             }
-            while (more);
 
-            if (counter < 3)
+            if (outputDSNs.size() > 1)
             {
-                ERR << "Wrong messages count: " << counter;
-
-                continue;
+                index = cheaperWorker(index, peers, streaming);
             }
 
-            string issuer, action;
-
-            issuer = getMessageData(items[0]);
-            action = getAction(getMessageData(items[2]));
+            currentWorkerIndex = index + 1;
 
-            if (action == "service.register")
-            {
-                registerWorker(issuer);
-            }
-            else if (action == "service.shutdown")
-            {
-                removeWorker(issuer);
+            takeWorker(workers[index]);
 
-                sendToWorker(issuer, "shutdown");
-            }
-            else if (action == "pong")
-            {
-                workerPong(issuer);
-            }
-            else if (action == "quit")
+            if (peers)
             {
-                interrupted = true;
+                (*federationForwarded)++;
             }
-            else
-            {
-                ERR << "Unknown service action: " << action;
-            }
-        }
 
-        if (interrupted)
-        {
-            break;
+            return &workers[index];
         }
     }
 
-    LOG << "Shutting down all workers";
-
-    shutdownAllWorkers();
-
-    LOG << "Service dispatcher thread finished";
+    return NULL;
 }
 
-
-broker::broker()
-    : currentWorkerIndex(0), connected(false), interrupted(false),
-      inputDSN("tcp://127.0.0.1:8100"), outputDSN("tcp://127.0.0.1:8101"), serviceDSN("tcp://127.0.0.1:8102")
+worker_t *broker::sampleWorker(bool streaming)
 {
-}
+    // two distinct local workers with spare credit, otherwise round robin scans for one
+    size_t count = workers.size();
 
-void broker::connect()
-{
-    if (connected)
+    if (count < 2)
     {
-        return;
+        return NULL;
     }
 
-    ctx = new zmq::context_t();
+    size_t    first  = rng() % count;
+    worker_t *a      = &workers[first];
+    worker_t *b      = &workers[(first + 1 + rng() % (count - 1)) % count];
+    worker_t *choice = NULL;
 
-    input = new zmq::socket_t(*ctx, ZMQ_PULL);
-    input->bind(inputDSN.c_str());
+    if (!a->peer && ready(*a) && (!streaming || a->streams))
+    {
+        choice = a;
+    }
 
-    output = new zmq::socket_t(*ctx, ZMQ_ROUTER);
-    output->bind(outputDSN.c_str());
+    if (!b->peer && ready(*b) && (!streaming || b->streams))
+    {
+        // unmeasured latency counts as 1 us, so new workers are tried early
+        double costA = (a->latency > 0 ? a->latency : 1) * (1 + a->load);
+        double costB = (b->latency > 0 ? b->latency : 1) * (1 + b->load);
 
-    service = new zmq::socket_t(*ctx, ZMQ_ROUTER);
-    service->bind(serviceDSN.c_str());
+        if (choice == NULL || costB < costA || (costB == costA && b->transport < a->transport))
+        {
+            choice = b;
+        }
+    }
 
-    LOG << "Listen:   input on " << inputDSN;
-    LOG << "Listen:  output on " << outputDSN;
-    LOG << "Listen: service on " << serviceDSN;
+    if (choice != NULL)
+    {
+        takeWorker(*choice);
+    }
 
-    connected = true;
+    return choice;
 }
 
-string broker::getAction(const string &data)
+size_t broker::cheaperWorker(size_t index, bool peers, bool streaming)
 {
-    Json::Value  root;   // will contains the root value after parsing.
-    Json::Reader reader;
+    // only workers with credit say how busy they are, the rest keep plain round robin; a cheaper one takes the
+    // message while more than half of its credit is free or it is no busier, the others get what it cannot keep up with
+    size_t count  = workers.size();
+    size_t chosen = index;
 
-    if (!reader.parse(data, root))
+    for (size_t i = 1; i < count && workers[chosen].credit > 0 && workers[chosen].transport > TRANSPORT_INPROC; i++)
     {
-        return "";
+        size_t    next  = (index + i) % count;
+        worker_t &other = workers[next];
+
+        if (other.peer == peers && other.credit > 0 && other.transport < workers[chosen].transport &&
+            (other.outstanding * 2 < other.credit || other.outstanding <= workers[chosen].outstanding) &&
+            ready(other) && (!streaming || other.streams))
+        {
+            chosen = next;
+        }
     }
 
-    return root.get("action", "").asString();
+    return chosen;
 }
 
-void broker::registerWorker(const string &id)
+void broker::takeWorker(worker_t &worker)
 {
-    workersLock.lock();
+    worker.outstanding++;
+    worker.sent++;
 
-    bool found = false;
-
-    for (int i = 0; i < workers.size(); i++)
+    if (worker.credit > 0)
     {
-        if (id == workers[i].name)
-        {
-            found = true;
+        worker.load += LOAD_EWMA_WEIGHT * (worker.outstanding - worker.load);
+    }
+}
 
-            ERR << "Worker already registered: " << id;
+void broker::workerDone(const slice_t &id, unsigned int count)
+{
+    worker_t *found = findWorker(toString(id));
 
-            break;
-        }
+    if (found == NULL)
+    {
+        return;
     }
 
-    if (!found)
-    {
-        worker_t wrk;
+    worker_t &worker = *found;
 
-        wrk.name = id;
-        wrk.heartbeatSent = 0;
-        wrk.lastHeartbitRecieved = 0;
+    worker.outstanding = worker.outstanding > count ? worker.outstanding - count : 0;
+    worker.load += LOAD_EWMA_WEIGHT * (worker.outstanding - worker.load);
+    worker.socketBacklog = min(worker.socketBacklog > count ? worker.socketBacklog - count : 0, worker.outstanding);
 
-        workers.push_back(wrk);
+    // workers finish messages in the order they got them
+    for (unsigned int i = 0; i < count && !worker.inFlight->empty(); i++)
+    {
+        if (worker.inFlight->front().trace != 0)
+        {
+            trace.record(worker.inFlight->front().trace, TRACE_DONE, &worker.name);
+        }
 
-        LOG << "Worker registered: " << id;
+        worker.inFlight->pop_front();
     }
 
+    if (worker.retiring && worker.outstanding == 0)
+    {
+        // removing the worker frees the name as well
+        string name = worker.name;
 
-    workersLock.unlock();
-
-    waitForWorkers.notify_all();
+        retireWorker(name);
+    }
 }
 
-void broker::removeWorker(const string &id)
+void broker::enqueueBatch(const string &workerName, zmq::message_t &message, uint32_t traceId)
 {
-    workersLock.lock();
+    batch_t &batch = batches[workerName];
 
-    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+    if (batch.messages.empty())
     {
-        if (id == (*it).name)
-        {
-            workers.erase(it);
-
-            break;
-        }
+        batch.started = chrono::steady_clock::now();
+        batchDeadlines.push_back(make_pair(batch.started, workerName));
     }
 
-    workersLock.unlock();
+    outgoing_message_t queued = {move(message), traceId};
 
-    LOG << "Worker unregistered: " << id;
-}
+    batch.messages.push_back(move(queued));
 
-void broker::send(const string &data)
-{
-    send(data, false);
+    if (batch.messages.size() >= batchSize)
+    {
+        flushBatch(workerName, batch);
+    }
 }
 
-void broker::sendMore(const string &data)
+worker_t *broker::findWorker(const string &id)
 {
-    send(data, true);
+    unordered_map<string, size_t>::iterator found = workerIndex.find(id);
+
+    return found == workerIndex.end() ? NULL : &workers[found->second];
 }
 
-void broker::send(const string &data, bool more)
+void broker::flushBatch(const string &workerName, batch_t &batch)
 {
-    zmq::message_t message(data.size());
-    memcpy(message.data(), data.data(), data.size());
+    worker_t *worker = findWorker(workerName);
 
-    if (more)
+    if (worker == NULL || !sendIdentity(*worker))
     {
-        output->send(message, ZMQ_SNDMORE);
+        // only input is batched, none of it was sent
+        for (size_t i = 0; i < batch.messages.size(); i++)
+        {
+            if ((worker == NULL || disconnected(*worker)) &&
+                redispatch(workerName, batch.messages[i].payload, batch.messages[i].trace))
+            {
+                continue;
+            }
+
+            (*outputFailed)++;
+
+            deadLetter(workerName, batch.messages[i].payload, DEAD_SEND_FAILED);
+        }
+
+        if (worker != NULL)
+        {
+            worker->outstanding = worker->outstanding > batch.messages.size() ? worker->outstanding - batch.messages.size() : 0;
+        }
+
+        batch.messages.clear();
+
+        return;
     }
-    else
+
+    for (size_t i = 0; i < batch.messages.size(); i++)
     {
-        output->send(message);
+        send(batch.messages[i].payload, i + 1 < batch.messages.size());
     }
-}
 
-void broker::send(const zmq::message_t &msg)
-{
-    send(msg, false);
-}
+    if (trace.enabled())
+    {
+        steady_time_t now = chrono::steady_clock::now();
 
-void broker::send(const zmq::message_t &msg, bool more)
-{
-    int  flags = 0;
-    bool result;
+        for (size_t i = 0; i < batch.messages.size(); i++)
+        {
+            if (batch.messages[i].trace != 0)
+            {
+                trace.record(batch.messages[i].trace, TRACE_SENT, now, &workerName);
+            }
+        }
+    }
 
-    zmq::message_t message(msg.size());
-    memcpy(message.data(), msg.data(), msg.size());
+    (*outputBatches)++;
+    (*outputBatchedMessages) += batch.messages.size();
 
-    if (more)
+    if (worker->credit > 0)
     {
-        flags = ZMQ_SNDMORE;
+        for (size_t i = 0; i < batch.messages.size(); i++)
+        {
+            worker->inFlight->push_back(move(batch.messages[i]));
+        }
     }
 
-    do
+    batch.messages.clear();
+}
+
+void broker::flushBatches(steady_time_t now, bool all)
+{
+    // deadlines are queued in the order batches were started, so the front always expires first
+    while (!batchDeadlines.empty() && (all || batchDeadlines.front().first + batchDelay <= now))
     {
-        result = output->send(message, flags);
+        unordered_map<string, batch_t>::iterator it = batches.find(batchDeadlines.front().second);
+
+        // batch could be flushed by size already and maybe started again since then
+        if (it != batches.end() && !it->second.messages.empty() && it->second.started == batchDeadlines.front().first)
+        {
+            flushBatch(it->first, it->second);
+        }
+
+        batchDeadlines.pop_front();
     }
-    while (!result); // eagain workaround
 }
 
-bool broker::getNextWorker(string &workerName)
+long broker::pollTimeout(steady_time_t now)
 {
-    workersLock.lock();
+    steady_time_t deadline = min(statsDue, nextHeartbeat);
 
-    while (workers.size() == 0)
+    if (!peers.empty())
     {
-        workersLock.unlock();
+        deadline = min(deadline, nextKeepAlive);
+    }
 
-        LOG << "wait for workers";
+    if (!batchDeadlines.empty())
+    {
+        deadline = min(deadline, batchDeadlines.front().first + batchDelay);
+    }
 
-        mutex m;
-        unique_lock<mutex> lock(m);
-        waitForWorkers.wait(lock);
+    if (acks.pending())
+    {
+        deadline = min(deadline, acks.nextDeadline());
+    }
 
-        LOG << "wait for workers: done";
+    if (holding && !held.admitted)
+    {
+        deadline = min(deadline, holdUntil);
+    }
 
-        workersLock.lock();
+    if (deadLetters.isDirty())
+    {
+        deadline = min(deadline, deadLettersFlushed + chrono::seconds(DEAD_LETTER_FLUSH_INTERVAL));
     }
 
-    if (currentWorkerIndex >= workers.size())
+    if (!draining && (localWorkers.enabled() || localWorkers.size() > 0))
     {
-        currentWorkerIndex = 0;
+        deadline = min(deadline, superviseDue);
     }
 
-    workerName = workers[currentWorkerIndex].name;
+    if (snapshotDirty && !snapshotPath.empty())
+    {
+        deadline = min(deadline, snapshotDue);
+    }
 
-    ++currentWorkerIndex;
+    if (delayed.size() > 0)
+    {
+        deadline = min(deadline, steady_time_t(chrono::milliseconds(delayed.nextTick())));
+    }
 
-    workersLock.unlock();
+    if (draining)
+    {
+        deadline = min(deadline, drainStarted + drainTimeout);
+    }
 
-    return true;
-}
+    if (deadline <= now)
+    {
+        return 0;
+    }
 
-string broker::getMessageData(zmq::message_t &message)
-{
-    return string(static_cast<char *>(message.data()), message.size());
+    // zmq_poll works in milliseconds, round up so the deadline is never missed by a busy loop
+    return (long) chrono::duration_cast<chrono::milliseconds>(deadline - now + chrono::microseconds(999)).count();
 }
 
 broker* broker::getInstance()
@@ -348,9 +2746,16 @@ broker* broker::getInstance()
 
 void broker::signalHandler(int signal)
 {
-    ERR << "Signal recieved: " << signal;
+    // only async-signal-safe calls here, the poll loop wakes up on the pipe and does the rest
+    int           saved  = errno;
+    unsigned char number = signal;
+
+    if (write(signalFd, &number, 1) < 0)
+    {
+        // pipe is full, a wakeup is pending anyway
+    }
 
-    getInstance()->interrupted = true;
+    errno = saved;
 }
 
 void broker::shutdownAllWorkers()
@@ -361,25 +2766,54 @@ void broker::shutdownAllWorkers()
     }
 }
 
-void broker::heartbeat()
+steady_time_t broker::heartbeat(steady_time_t now)
 {
-    BOOST_LOG_SCOPED_THREAD_TAG("ThreadID", boost::this_thread::get_id());
+    steady_time_t  next = now + heartbeatInterval;
+    vector<string> toRemove;
+    vector<string> unanswered;
 
-    LOG << "Heartbit thread started";
-
-    while (true)
+    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
     {
-        vector<string> toRemove;
-        workersLock.lock();
+        worker_t& worker = *it;
 
-        for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+        if (worker.probeUntil != steady_time_t())
         {
-            time_t    now;
-            worker_t& worker = *it;
+            if (worker.probeUntil <= now)
+            {
+                ERR << "Worker not restored [timeout]: " << worker.name;
+
+                unanswered.push_back(worker.name);
+
+                continue;
+            }
 
-            time(&now);
+            steady_time_t due = worker.heartbeatSent + chrono::milliseconds(WORKER_PROBE_INTERVAL_MS);
 
-            if (0 != worker.heartbeatSent && abs(difftime(worker.heartbeatSent, (0 == worker.lastHeartbitRecieved ? now : worker.lastHeartbitRecieved))) > WORKER_HB_TIMEOUT)
+            // the worker may not have reconnected to output yet, pings are repeated until one gets through
+            if (due <= now)
+            {
+                if (sendIdentity(worker))
+                {
+                    send(controlMessage("ping"));
+                }
+
+                worker.heartbeatSent = now;
+
+                due = now + chrono::milliseconds(WORKER_PROBE_INTERVAL_MS);
+            }
+
+            next = min(next, min(due, worker.probeUntil));
+
+            continue;
+        }
+
+        if (worker.lastHeartbitRecieved < worker.heartbeatSent)
+        {
+            // while draining its messages in flight are dead lettered soon rather than waited for
+            steady_time_t expires = worker.heartbeatSent + (draining ? chrono::milliseconds(DRAIN_PONG_TIMEOUT_MS)
+                                                                     : chrono::milliseconds(heartbeatTimeout));
+
+            if (expires <= now)
             {
                 // shutdown worker if heartbeat timed out
                 ERR << "Worker shutdown [timeout]: " << worker.name;
@@ -389,75 +2823,122 @@ void broker::heartbeat()
                 continue;
             }
 
-            if (worker.heartbeatSent == 0 || difftime(now, worker.heartbeatSent) > WORKER_HB_INTERVAL)
-            {
-                sendToWorker(worker.name, "ping");
-                worker.heartbeatSent = now;
+            next = min(next, expires);
 
-                LOG << "[ping] " << worker.name;
-            }
+            continue;
         }
 
-        workersLock.unlock();
+        steady_time_t due = worker.heartbeatSent + heartbeatInterval;
 
-        for (vector<string>::iterator it = toRemove.begin(); it < toRemove.end(); it++)
+        if (worker.heartbeatSent == steady_time_t() || due <= now)
         {
-            sendToWorker(*it, "shutdown");
-            removeWorker(*it);
+            sendToWorker(worker.name, "ping");
+            worker.heartbeatSent = now;
+
+            LOG << "[ping] " << worker.name;
+
+            due = now + heartbeatTimeout;
         }
 
-        toRemove.clear();
+        next = min(next, due);
+    }
 
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+    for (vector<string>::iterator it = toRemove.begin(); it < toRemove.end(); it++)
+    {
+        sendToWorker(*it, "shutdown");
+        removeWorker(*it);
+    }
 
-        if (interrupted)
-        {
-            break;
-        }
+    for (vector<string>::iterator it = unanswered.begin(); it < unanswered.end(); it++)
+    {
+        removeWorker(*it);
     }
 
-    LOG << "Heartbit thread finished";
+    return next;
 }
 
-
-void broker::workerPong(const string &id)
+void broker::workerPong(const slice_t &id)
 {
-    workersLock.lock();
+    worker_t *found = findWorker(toString(id));
 
-    for (vector<worker_t>::iterator it = workers.begin(); it < workers.end(); it++)
+    if (found == NULL)
     {
-        worker_t & worker = *it;
+        return;
+    }
 
-        if (id == worker.name)
-        {
-            time(&worker.lastHeartbitRecieved);
+    worker_t &worker = *found;
 
-            LOG << "[pong] " << id << ": " << difftime(worker.lastHeartbitRecieved, worker.heartbeatSent) << " sec";
+    worker.lastHeartbitRecieved = chrono::steady_clock::now();
 
-            break;
-        }
-    }
+    double rtt = chrono::duration_cast<chrono::microseconds>(worker.lastHeartbitRecieved - worker.heartbeatSent).count();
 
-    workersLock.unlock();
+    worker.latency = worker.latency > 0 ? worker.latency + LATENCY_EWMA_WEIGHT * (rtt - worker.latency) : rtt;
+
+    LOG << "[pong] " << worker.name << ": " << rtt / 1000.0 << " ms, avg " << worker.latency / 1000.0 << " ms";
+
+    if (worker.probeUntil != steady_time_t())
+    {
+        worker.probeUntil = steady_time_t();
+
+        LOG << "Worker restored: " << worker.name;
+    }
 }
 
 void broker::sendToWorker(const string &id, const string &data)
 {
-    stringstream ss;
+    if (!sendIdentity(id))
+    {
+        ERR << "Send faied [" << id << "]: " << data;
 
-    ss << "{\"action\":\"" << data << "\",\"history\":[],\"issuer\":\"service_queue\",\"data\":[],\"sections\":{}}";
+        return;
+    }
 
-    writeLock.lock();
+    send(controlMessage(data));
+}
 
-    try
+void broker::receiveForeign(peer_link &peer)
+{
+    for (int i = 0; i < POLL_BURST && (i == 0 || readable(*peer.getOutput())); i++)
     {
-        sendMore(id);
-        send(ss.str());
+        zmq::message_t message;
+
+        peer.getOutput()->recv(&message);
+
+        if (isControlMessage(message, "ping"))
+        {
+            peer.pong();
+        }
+        else if (isControlMessage(message, "shutdown"))
+        {
+            peer.lost();
+        }
+        else
+        {
+            foreign.push_back(move(message));
+            origins.push_back(&peer);
+        }
     }
-    catch (zmq::error_t e)
+}
+
+void broker::dispatchForeign()
+{
+    // foreign work goes to local workers with spare credit only, otherwise it waits here
+    while (!foreign.empty())
     {
-        ERR << "Send faied: error " << e.num() << ": " << e.what();
-    }
+        worker_t *worker = selectWorker(false);
 
-    writeLock.unlock();
+        if (worker == NULL)
+        {
+            break;
+        }
+
+        deliver(*worker, foreign.front(), 0, false);
+
+        origins.front()->done();
+
+        foreign.pop_front();
+        origins.pop_front();
+
+        (*federationReceived)++;
+    }
 }
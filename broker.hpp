@@ -2,19 +2,138 @@
 #define SERVICE_QUEUE_BROKER_H
 
 #include "zmq.hpp"
+#include "metrics.hpp"
+#include "rate_limiter.hpp"
+#include "peer_link.hpp"
+#include "ack_tracker.hpp"
+#include "json_scanner.hpp"
+#include "protocol.hpp"
+#include "shm_ring.hpp"
+#include "dead_letters.hpp"
+#include "tracer.hpp"
+#include "fair_queue.hpp"
+#include "worker_snapshot.hpp"
+#include "timing_wheel.hpp"
+#include "dedup_filter.hpp"
+#include "supervisor.hpp"
+#include "compressor.hpp"
 #include <vector>
-#include <mutex>
-#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <random>
+#include <memory>
+#include <functional>
+#include <unistd.h>
 
 using namespace std;
+using service_queue::shm_ring;
 
 typedef struct
 {
-    string name;
-    time_t heartbeatSent;
-    time_t lastHeartbitRecieved;
+    zmq::message_t payload;
+    uint32_t       trace; // tracer id, 0 - not sampled
+} outgoing_message_t;
+
+// How a worker reaches the output, cheapest first; taken from the output endpoint it reports at registration
+typedef enum
+{
+    TRANSPORT_INPROC,
+    TRANSPORT_IPC,
+    TRANSPORT_LOOPBACK, // tcp on this host
+    TRANSPORT_NETWORK   // tcp elsewhere, or not reported
+} transport_t;
+
+typedef struct
+{
+    string        name;
+    string        registration; // service.register request, kept for the snapshot
+    zmq::message_t identity;    // name as a frame, sent as a copy sharing its data
+    steady_time_t registered;
+    steady_time_t heartbeatSent;
+    steady_time_t lastHeartbitRecieved;
+    bool          batch;   // accepts several payloads in one multipart delivery
+    bool          streams; // takes chunked streams
+    bool          peer;  // peer broker taking our overflow, used only when local workers are out of credit
+    transport_t   transport;
+    codec_t       codec;   // negotiated at registration, workers on other hosts only
+    size_t        compressions; // its payloads in the compressor, the rest queues up behind them while there are any
+
+    unsigned int credit;      // max messages in flight, 0 - unlimited (worker does not report "done")
+    unsigned int outstanding;
+    uint64_t     sent;        // messages handed to it since it registered
+
+    double latency; // EWMA of ping round trip, microseconds, 0 - not measured yet
+    double load;    // EWMA of outstanding messages, stays 0 for workers without credit
+
+    shared_ptr<shm_ring> ring; // payloads go here instead of output, worker is on this host
+    unsigned int         socketBacklog; // not done up to its last payload sent over the socket, ring unused until 0
+
+    shared_ptr<deque<outgoing_message_t> > inFlight; // sent and not reported done yet, credit workers only
+
+    // restored from the snapshot or registered before its output connection was up, and not answered a ping yet;
+    // gets no messages meanwhile
+    steady_time_t probeUntil;
+
+    bool unreachable; // a send failed with EHOSTUNREACH, removed before anything else is dispatched
+
+    bool quarantined; // kept out of dispatch by admin.quarantine until admin.release, stays registered
+    bool retiring;    // admin.drain: gets no new messages and is shut down once those in flight are done
 } worker_t;
 
+typedef struct
+{
+    vector<outgoing_message_t> messages;
+    steady_time_t              started;
+} batch_t;
+
+typedef struct
+{
+    zmq::message_t header; // as the producer sent it, passed on to the worker
+    zmq::message_t payload;
+    uint32_t       trace;
+} stream_chunk_t;
+
+typedef struct
+{
+    string                worker;   // every chunk goes to it, empty once it is lost
+    deque<stream_chunk_t> pending;  // waiting for the worker's credit, up to the stream window
+    bool                  finished; // last chunk received
+    bool                  refused;  // no worker took streams when it started, all its chunks are dead lettered
+    steady_time_t         updated;
+} stream_t;
+
+typedef struct
+{
+    bool           acknowledged; // came from the acknowledged input, fields below are set
+    bool           fair;         // came from the fair input, producer is the tenant
+    bool           admitted;     // passed the rate limiter, only waits for a worker now
+    bool           throttled;
+    zmq::message_t identity;
+    string         producer;
+    uint64_t       seq;
+    uint32_t       trace;
+    steady_time_t  deliverAt; // from the delay header, zero - at once
+    bool           keyed;     // header has an idempotency key, its hash is in key
+    uint64_t       key;
+    string         stream;    // chunk of this stream, header is kept for the worker
+    bool           lastChunk;
+    zmq::message_t header;
+    zmq::message_t payload;
+} input_message_t;
+
+typedef enum
+{
+    SCHEDULER_ROUND_ROBIN,
+    SCHEDULER_P2C // less loaded of two randomly sampled workers
+} scheduler_t;
+
+typedef enum
+{
+    ADMIT_ACCEPTED,
+    ADMIT_SHED,
+    ADMIT_THROTTLED
+} admission_t;
+
 class broker
 {
 
@@ -24,34 +143,236 @@ private:
     zmq::socket_t *input;
     zmq::socket_t *output;
     zmq::socket_t *service;
+    zmq::socket_t *ackInput;
+    zmq::socket_t *fairInput;
+    zmq::socket_t *broadcastInput;
 
     string inputDSN;
-    string outputDSN;
+    string ackInputDSN;
+    string fairInputDSN;
+    string broadcastInputDSN;
+    vector<string> outputDSNs; // all bound on output, a worker connects to any of them
     string serviceDSN;
+    string hostName;
 
-    vector<worker_t> workers;
+    vector<worker_t>              workers;
+    unordered_map<string, size_t> workerIndex; // identity to position in workers
+    vector<string>                unreachable; // workers to remove, see removeUnreachable()
     int currentWorkerIndex;
 
-    mutex writeLock;
-    mutex workersLock;
-
-    condition_variable waitForWorkers;
+    scheduler_t  scheduler;
+    minstd_rand  rng;
 
     bool connected;
     bool interrupted;
 
+    // signals are written to the pipe and handled by the poll loop
+    int        wakeup[2];
+    static int signalFd;
+
+    // input message waiting for a worker or the rate limiter, input is not polled meanwhile
+    input_message_t held;
+    bool            holding;
+    bool            waitingForWorkers;
+    steady_time_t   holdUntil;
+    steady_time_t   starvedSince; // input is behind for want of workers since, zero - all of it was read
+
+    // wakeup, service and input always, optional inputs and peer links after them, see buildPollItems()
+    vector<zmq::pollitem_t> pollItems;
+    bool                    pollItemsChanged;
+    size_t                  ackIndex;
+    size_t                  fairIndex;
+    size_t                  broadcastIndex;
+    size_t                  peersIndex;
+
+    chrono::seconds heartbeatInterval;
+    chrono::seconds heartbeatTimeout;
+
+    // SIGTERM stops reading input and waits up to drainTimeout for queued and in-flight messages, 0 - exit at once
+    bool            draining;
+    chrono::seconds drainTimeout;
+    steady_time_t   drainStarted;
+
+    // reads the configuration again and applies it through the setters, false keeps the current one
+    function<bool ()> reloadHandler;
+
+    steady_time_t nextHeartbeat;
+    steady_time_t nextKeepAlive;
+    steady_time_t statsDue;
+    steady_time_t superviseDue;
+
+    rate_limiter limiter;
+    ack_tracker  acks;
+    fair_queue   fair;
+    dedup_filter dedup;
+    supervisor   localWorkers;
+
+    // admitted messages waiting for their delivery time, then for a worker like the rest of the input
+    timing_wheel             delayed;
+    deque<delayed_message_t> due;
+
+    // sent to a worker that turned out to be gone, they wait for another one like held input
+    deque<outgoing_message_t> unsent;
+
+    size_t               batchSize;
+    chrono::microseconds batchDelay;
+
+    // chunks of a stream all go to the worker that got the first one
+    unordered_map<string, stream_t> streams;
+    size_t                          streamChunks; // pending in all streams
+    size_t                          streamWindow;
+    chrono::seconds                 streamIdleTimeout;
+    zmq::message_t                  chunkFrame;   // marks a chunk delivery for the worker
+
+    // payloads of at least compressionThreshold bytes go to workers with a codec through the compressor
+    compressor     compressing;
+    size_t         compressionThreads;
+    size_t         compressionThreshold;
+    zmq::message_t codecFrames[CODEC_COUNT]; // mark a compressed delivery
+
+    unordered_map<string, batch_t>       batches;
+    deque<pair<steady_time_t, string> >  batchDeadlines;
+
+    string             federationName;
+    unsigned int       federationCredit;
+    vector<peer_link>  peers;
+
+    // work overflowed to us by peers, never forwarded again so messages cannot loop between brokers
+    deque<zmq::message_t> foreign;
+    deque<peer_link *>    origins;
+
+    dead_letter_store deadLetters;
+    steady_time_t     deadLettersFlushed;
+
+    tracer trace;
+    string traceDirectory;
+
+    string        snapshotPath;
+    bool          snapshotDirty;
+    steady_time_t snapshotDue;
+
+    metrics    stats;
+    counter_t *inputReceived;
+    counter_t *inputShed;
+    counter_t *inputThrottled;
+    counter_t *outputBatches;
+    counter_t *outputBatchedMessages;
+    counter_t *outputShared;
+    counter_t *outputSharedFull;
+    counter_t *outputFailed;
+    counter_t *outputRedispatched;
+    counter_t *outputOrphaned;
+    counter_t *deadLettersWritten;
+    counter_t *deadLettersFailed;
+    counter_t *delayedScheduled;
+    counter_t *delayedReleased;
+    counter_t *delayedPending;
+    counter_t *delayedLag;
+    counter_t *dedupDropped;
+    counter_t *dedupMemory;
+    counter_t *dedupFalsePositives;
+    counter_t *streamsStarted;
+    counter_t *streamsActive;
+    counter_t *streamsBroken;
+    counter_t *streamChunksSent;
+    counter_t *broadcastReceived;
+    counter_t *broadcastSent;
+    counter_t *federationForwarded;
+    counter_t *federationReceived;
+    counter_t *compressionPayloads;
+    counter_t *compressionSkipped;
+    counter_t *compressionQueueFull;
+    counter_t *compressionBytesIn;
+    counter_t *compressionBytesOut;
+    counter_t *compressionRatio;
+    counter_t *compressionCpu;
+    counter_t *compressionPending;
+
     void connect();
 
-    void registerWorker(const string &id);
+    void handleSignals();
+    void buildPollItems();
+    void reload();
+    void rebind(zmq::socket_t &socket, string &dsn, const string &previous, const char *name);
+    void rebindOutputs(const vector<string> &previous);
+    void openInput(zmq::socket_t *&socket, int type, string &dsn, const string &previous, const char *name);
+    void dumpTrace();
+    void startDrain(steady_time_t now);
+    size_t queuedMessages();   // held, fair queued, due, stream, batched and foreign
+    size_t inFlightMessages(); // sent to credit workers and not reported done
+    void runTimers(steady_time_t now);
+    void supervise(steady_time_t now);
+    void stopLocalWorkers(); // on shutdown, the poll loop is over
+    void updateGauges();
+    void logStats();
+
+    void receiveInputs(zmq::socket_t &socket, bool acknowledged, steady_time_t now);
+    bool receiveInput(zmq::socket_t &socket, bool acknowledged, input_message_t &message);
+    bool dispatchInput(input_message_t &message, steady_time_t now);
+    admission_t admitInput(input_message_t &message, steady_time_t now);
+    void receiveFair();
+    void receiveBroadcasts();
+    void dispatchFair(steady_time_t now);
+    void schedule(input_message_t &message, steady_time_t now);
+    void dispatchDelayed(steady_time_t now);
+    void accepted(input_message_t &message, steady_time_t now);
+    // input - came through dispatchInput(): may be batched, and goes to another worker if this one is gone
+    void deliver(worker_t &worker, zmq::message_t &payload, uint32_t traceId, bool input);
+    void transmit(worker_t &worker, zmq::message_t &payload, uint32_t traceId, bool input, codec_t codec,
+                  const zmq::message_t *compressed);
+    void sendCompressed();
+    bool dispatchChunk(input_message_t &message, steady_time_t now);
+    bool takesStreams();
+    void dispatchStreams();
+    void sendChunk(worker_t &worker, zmq::message_t &header, zmq::message_t &payload, uint32_t traceId);
+    void breakStreams(string worker); // a copy, the name is cleared in the streams it is taken from
+    void sweepStreams(steady_time_t now);
+    void deadLetter(const string &worker, const zmq::message_t &payload, dead_reason_t reason);
+
+    void registerWorker(const string &id, const slice_t &request);
+    void restoreWorkers(steady_time_t now);
+    void saveWorkers();
     void removeWorker(const string &id);
-    bool getNextWorker(string &workerName);
+    void eraseWorker(size_t index);
+    void markUnreachable(const string &id);
+    void removeUnreachable();
+    bool redispatch(const string &from, zmq::message_t &payload, uint32_t traceId);
+    void dispatchUnsent(steady_time_t now);
+    worker_t *selectWorker(bool allowPeers, bool streaming = false);
+    worker_t *sampleWorker(bool streaming);
+    size_t    cheaperWorker(size_t index, bool peers, bool streaming);
+    void      takeWorker(worker_t &worker);
+    void workerDone(const slice_t &id, unsigned int count);
+
+    worker_t *findWorker(const string &id);
+
+    void enqueueBatch(const string &workerName, zmq::message_t &message, uint32_t traceId);
+    void flushBatch(const string &workerName, batch_t &batch);
+    void flushBatches(steady_time_t now, bool all);
+    long pollTimeout(steady_time_t now);
 
     void shutdownAllWorkers();
 
+    void receiveForeign(peer_link &peer);
+    void dispatchForeign();
+
+    zmq::message_t serviceFrames[3];
+    zmq::message_t serviceExtra;
+
     void dispatchService();
+    void replyService(const slice_t &issuer, const string &data);
+
+    // service_queue_ctl requests, answered with JSON; the loop is single threaded, so the state is consistent
+    string adminStatus();
+    string adminWorker(service_action_t action, const slice_t &request);
+    bool   drainWorker(worker_t &worker); // true - shut down at once
+    void   retireWorker(const string &id);
+
+    bool sendIdentity(const string &id);
+    bool sendIdentity(worker_t &worker);
+    bool sendIdentity(zmq::message_t &identity, const string &id);
 
     void send(const string &data);
-    void sendMore(const string &data);
     void send(const string &data, bool more);
 
     void send(const zmq::message_t &msg);
@@ -59,13 +380,10 @@ private:
 
     void sendToWorker(const string &id, const string &data);
 
-    string getAction(const string &data);
-    string getMessageData(zmq::message_t &message);
-
     static broker instance;
 
-    void heartbeat();
-    void workerPong(const string &id);
+    steady_time_t heartbeat(steady_time_t now);
+    void workerPong(const slice_t &id);
 
 public:
     broker();
@@ -77,9 +395,40 @@ public:
         broker::inputDSN = inputDSN;
     }
 
-    void setOutputDSN(string outputDSN)
+    void setAckInputDSN(string ackInputDSN)
+    {
+        broker::ackInputDSN = ackInputDSN;
+    }
+
+    void setFairInputDSN(string fairInputDSN)
     {
-        broker::outputDSN = outputDSN;
+        broker::fairInputDSN = fairInputDSN;
+    }
+
+    void setBroadcastInputDSN(string broadcastInputDSN)
+    {
+        broker::broadcastInputDSN = broadcastInputDSN;
+    }
+
+    void setFairQueuing(size_t quantum, size_t tenantLimit, size_t totalLimit)
+    {
+        fair.configure(quantum, tenantLimit, totalLimit);
+    }
+
+    // 0 capacity turns deduplication off
+    void setDedup(size_t capacity, double falsePositiveRate, long windowSec)
+    {
+        dedup.configure(capacity, falsePositiveRate, windowSec);
+    }
+
+    void setAcks(unsigned int batch, long intervalMs)
+    {
+        acks.configure(batch, intervalMs);
+    }
+
+    void setOutputDSNs(const vector<string> &outputDSNs)
+    {
+        broker::outputDSNs = outputDSNs;
     }
 
     void setServiceDSN(string serviceDSN)
@@ -87,6 +436,94 @@ public:
         broker::serviceDSN = serviceDSN;
     }
 
+    void setGlobalRateLimit(double rate, double burst)
+    {
+        limiter.setGlobalLimit(rate, burst);
+    }
+
+    void setProducerRateLimit(double rate, double burst)
+    {
+        limiter.setProducerLimit(rate, burst);
+    }
+
+    void setScheduler(scheduler_t scheduler)
+    {
+        broker::scheduler = scheduler;
+    }
+
+    void setOverflowPolicy(overflow_policy_t policy)
+    {
+        limiter.setPolicy(policy);
+    }
+
+    void setStreaming(size_t window, long idleTimeoutSec)
+    {
+        streamWindow = window < 1 ? 1 : window;
+        streamIdleTimeout = chrono::seconds(idleTimeoutSec);
+    }
+
+    // threads are started once, 0 - no compression
+    void setCompression(size_t threads, size_t threshold, int level, double maxRatio)
+    {
+        compressionThreads = threads;
+        compressionThreshold = threshold;
+        compressing.configure(level, maxRatio);
+    }
+
+    void setBatching(size_t maxMessages, long maxDelayUs)
+    {
+        batchSize = maxMessages;
+        batchDelay = chrono::microseconds(maxDelayUs);
+    }
+
+    // empty directory turns dead letters off, the store is reopened only when something changed
+    bool setDeadLetters(const string &directory, size_t segmentSize);
+
+    void setHeartbeat(long intervalSec, long timeoutSec)
+    {
+        heartbeatInterval = chrono::seconds(intervalSec);
+        heartbeatTimeout = chrono::seconds(timeoutSec);
+    }
+
+    void setDrainTimeout(long timeoutSec)
+    {
+        drainTimeout = chrono::seconds(timeoutSec);
+    }
+
+    // empty command - no local workers, those started before are stopped
+    void setSupervisor(const string &command, size_t minimum, size_t maximum, size_t upQueue, long upWaitMs,
+                       long idleSec, long stopTimeoutSec)
+    {
+        localWorkers.configure(command, minimum, maximum, upQueue, upWaitMs, idleSec, stopTimeoutSec);
+    }
+
+    void setReloadHandler(function<bool ()> handler)
+    {
+        reloadHandler = handler;
+    }
+
+    void setWorkerSnapshot(const string &path)
+    {
+        snapshotPath = path;
+    }
+
+    void setTracing(unsigned int every, size_t events, const string &directory)
+    {
+        trace.configure(every, events);
+        traceDirectory = directory;
+    }
+
+    void setFederation(string name, unsigned int credit)
+    {
+        federationName = name;
+        federationCredit = credit;
+    }
+
+    void addPeer(string outputDSN, string serviceDSN)
+    {
+        peers.push_back(peer_link(outputDSN, serviceDSN));
+    }
+
     virtual ~broker()
     {
         if (connected)
@@ -94,13 +531,38 @@ public:
             input->close();
             output->close();
             service->close();
+
+            if (ackInput != NULL)
+            {
+                ackInput->close();
+            }
+
+            if (fairInput != NULL)
+            {
+                fairInput->close();
+            }
+
+            if (broadcastInput != NULL)
+            {
+                broadcastInput->close();
+            }
+
             ctx->close();
 
             delete input;
             delete output;
             delete service;
+            delete ackInput;
+            delete fairInput;
+            delete broadcastInput;
             delete ctx;
         }
+
+        if (wakeup[0] >= 0)
+        {
+            close(wakeup[0]);
+            close(wakeup[1]);
+        }
     }
 
     static broker * getInstance();
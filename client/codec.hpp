@@ -0,0 +1,201 @@
+#ifndef SERVICE_QUEUE_CLIENT_CODEC_H
+#define SERVICE_QUEUE_CLIENT_CODEC_H
+
+#include "protocol.hpp"
+#include <string>
+#include <stdint.h>
+
+#ifdef SERVICE_QUEUE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef SERVICE_QUEUE_ZSTD
+#include <zstd.h>
+#endif
+
+#define CODEC_COUNT 3
+
+// Payload compression for workers on other hosts, shared by the broker and the worker library.
+// A codec exists only when built in: -DSERVICE_QUEUE_LZ4 with liblz4, -DSERVICE_QUEUE_ZSTD with libzstd.
+// A compressed delivery is [codec marker][original size][compressed payload], the size as in encodeSeq().
+namespace service_queue
+{
+    typedef enum
+    {
+        CODEC_NONE,
+        CODEC_LZ4,
+        CODEC_ZSTD
+    } codec_t;
+
+    inline const char *codecName(codec_t codec)
+    {
+        static const char *names[CODEC_COUNT] = {"none", "lz4", "zstd"};
+
+        return names[codec];
+    }
+
+    inline bool codecAvailable(codec_t codec)
+    {
+        switch (codec)
+        {
+#ifdef SERVICE_QUEUE_LZ4
+            case CODEC_LZ4:
+                return true;
+#endif
+#ifdef SERVICE_QUEUE_ZSTD
+            case CODEC_ZSTD:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    // Control message in front of a compressed payload
+    inline std::string codecMarker(codec_t codec)
+    {
+        return controlMessage(std::string("compressed.") + codecName(codec));
+    }
+
+    // Codec a marker frame stands for, CODEC_NONE when it is not one;
+    // only a frame followed by another can be a marker
+    inline codec_t codecOfMarker(const zmq::message_t &frame)
+    {
+        if (isControlMessage(frame, "compressed.lz4"))
+        {
+            return CODEC_LZ4;
+        }
+
+        if (isControlMessage(frame, "compressed.zstd"))
+        {
+            return CODEC_ZSTD;
+        }
+
+        return CODEC_NONE;
+    }
+
+    // Built in codecs as a JSON array, the better ratio first; "[]" when there are none
+    inline std::string availableCodecs()
+    {
+        std::string list;
+
+        for (int codec = CODEC_COUNT - 1; codec > CODEC_NONE; codec--)
+        {
+            if (codecAvailable((codec_t) codec))
+            {
+                list += std::string(list.empty() ? "" : ",") + "\"" + codecName((codec_t) codec) + "\"";
+            }
+        }
+
+        return "[" + list + "]";
+    }
+
+    // Bytes compressPayload() may need, 0 - the codec cannot take this much
+    inline size_t compressBound(codec_t codec, size_t size)
+    {
+        switch (codec)
+        {
+#ifdef SERVICE_QUEUE_LZ4
+            case CODEC_LZ4:
+                return size > LZ4_MAX_INPUT_SIZE ? 0 : SEQ_SIZE + LZ4_compressBound((int) size);
+#endif
+#ifdef SERVICE_QUEUE_ZSTD
+            case CODEC_ZSTD:
+                return SEQ_SIZE + ZSTD_compressBound(size);
+#endif
+            default:
+                // used only by the codecs built in
+                (void) size;
+
+                return 0;
+        }
+    }
+
+    // Writes [original size][compressed payload] to out, returns its size, 0 - failed; level is used by zstd only
+    inline size_t compressPayload(codec_t codec, int level, const void *data, size_t size, void *out, size_t capacity)
+    {
+        char *buffer = static_cast<char *>(out);
+
+        if (capacity < SEQ_SIZE)
+        {
+            return 0;
+        }
+
+        encodeSeq(size, buffer);
+
+        switch (codec)
+        {
+#ifdef SERVICE_QUEUE_LZ4
+            case CODEC_LZ4:
+            {
+                int written = LZ4_compress_default(static_cast<const char *>(data), buffer + SEQ_SIZE, (int) size,
+                                                   (int) (capacity - SEQ_SIZE));
+
+                return written > 0 ? SEQ_SIZE + written : 0;
+            }
+#endif
+#ifdef SERVICE_QUEUE_ZSTD
+            case CODEC_ZSTD:
+            {
+                size_t written = ZSTD_compress(buffer + SEQ_SIZE, capacity - SEQ_SIZE, data, size, level);
+
+                return ZSTD_isError(written) ? 0 : SEQ_SIZE + written;
+            }
+#endif
+            default:
+                (void) level;
+                (void) data;
+
+                return 0;
+        }
+    }
+
+    // Restores a payload written by compressPayload(), false - corrupt or the codec is not built in
+    inline bool decompressPayload(codec_t codec, const void *data, size_t size, std::string &out)
+    {
+        const char *buffer = static_cast<const char *>(data);
+
+        if (size < SEQ_SIZE)
+        {
+            return false;
+        }
+
+        uint64_t original = decodeSeq(buffer);
+
+        switch (codec)
+        {
+#ifdef SERVICE_QUEUE_LZ4
+            case CODEC_LZ4:
+            {
+                if (original > LZ4_MAX_INPUT_SIZE)
+                {
+                    return false;
+                }
+
+                out.resize(original);
+
+                int read = LZ4_decompress_safe(buffer + SEQ_SIZE, &out[0], (int) (size - SEQ_SIZE), (int) original);
+
+                return read >= 0 && (uint64_t) read == original;
+            }
+#endif
+#ifdef SERVICE_QUEUE_ZSTD
+            case CODEC_ZSTD:
+            {
+                out.resize(original);
+
+                size_t read = ZSTD_decompress(&out[0], original, buffer + SEQ_SIZE, size - SEQ_SIZE);
+
+                return !ZSTD_isError(read) && read == original;
+            }
+#endif
+            default:
+                (void) original;
+                (void) out;
+
+                return false;
+        }
+    }
+}
+
+#endif //SERVICE_QUEUE_CLIENT_CODEC_H
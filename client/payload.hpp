@@ -0,0 +1,21 @@
+#ifndef SERVICE_QUEUE_CLIENT_PAYLOAD_H
+#define SERVICE_QUEUE_CLIENT_PAYLOAD_H
+
+#include <string>
+
+namespace service_queue
+{
+    // Payload inside a frame owned by the library, valid only while the callback runs
+    struct payload_view
+    {
+        const char *data;
+        size_t      size;
+
+        std::string str() const
+        {
+            return std::string(data, size);
+        }
+    };
+}
+
+#endif //SERVICE_QUEUE_CLIENT_PAYLOAD_H
@@ -0,0 +1,308 @@
+#ifndef SERVICE_QUEUE_CLIENT_PRODUCER_H
+#define SERVICE_QUEUE_CLIENT_PRODUCER_H
+
+#include "protocol.hpp"
+#include "payload.hpp"
+#include <zmq.hpp>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+
+namespace service_queue
+{
+    // Producer for the acknowledged input (ports.ack_input).
+    //
+    // Messages are pipelined: up to window of them may wait for the broker's cumulative ack, send() blocks
+    // only while the window is full. Rejected messages (shed by rate limits or lost on reconnect) are sent
+    // again after a delay, unacknowledged ones after the ack timeout, so delivery is at least once.
+    class producer
+    {
+    public:
+        typedef std::function<void (const payload_view &)> reject_handler_t;
+
+        producer(const std::string &inputDSN, const std::string &identity = "")
+            : ctx(1), socket(ctx, ZMQ_DEALER), nextSeq(1), window(1000),
+              ackTimeout(std::chrono::milliseconds(5000)), retryDelay(std::chrono::milliseconds(100))
+        {
+            int linger = 1000;
+
+            if (!identity.empty())
+            {
+                socket.setsockopt(ZMQ_IDENTITY, identity.data(), identity.size());
+            }
+
+            socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+            socket.connect(inputDSN.c_str());
+        }
+
+        // Max messages waiting for an ack
+        void setWindow(size_t window)
+        {
+            producer::window = window < 1 ? 1 : window;
+        }
+
+        // Messages without an ack for this long are sent again
+        void setAckTimeout(int ms)
+        {
+            ackTimeout = std::chrono::milliseconds(ms);
+        }
+
+        // Rejected messages are sent again after this delay
+        void setRetryDelay(int ms)
+        {
+            retryDelay = std::chrono::milliseconds(ms);
+        }
+
+        // With a handler set rejected messages are passed to it and dropped instead of being sent again
+        void setRejectHandler(reject_handler_t handler)
+        {
+            rejectHandler = handler;
+        }
+
+        // header is a JSON object sent with every attempt, e.g. {"idempotency_key": "order-42"} so the broker
+        // drops retries it got already, or {"delay_ms": 5000}
+        void send(const void *data, size_t size, const std::string &header = "")
+        {
+            zmq::message_t payload(size);
+
+            memcpy(payload.data(), data, size);
+
+            send(payload, header);
+        }
+
+        // Sends size bytes in chunks of chunkSize that all go to one worker, see worker::setStreamHandler().
+        // Only the window of chunks is held here and in the broker, not the whole payload.
+        void sendStream(const std::string &stream, const void *data, size_t size, size_t chunkSize)
+        {
+            chunkSize = std::max(chunkSize, (size_t) 1);
+
+            size_t chunks = size == 0 ? 1 : (size + chunkSize - 1) / chunkSize;
+
+            std::string id = jsonEscape(stream);
+
+            for (size_t i = 0; i < chunks; i++)
+            {
+                size_t            offset = i * chunkSize;
+                std::stringstream header;
+
+                // the key lets the broker drop chunks sent again when deduplication is on
+                header << "{\"stream\":\"" << id << "\",\"chunk\":" << i << ",\"last\":" << (i + 1 == chunks ? "true" : "false")
+                       << ",\"idempotency_key\":\"" << id << "/" << i << "\"}";
+
+                send(static_cast<const char *>(data) + offset, std::min(chunkSize, size - offset), header.str());
+            }
+        }
+
+        // Takes the payload over, it is kept (not copied) until acknowledged
+        void send(zmq::message_t &payload, const std::string &header = "")
+        {
+            receiveAcks();
+
+            while (outstanding() >= window)
+            {
+                poll(std::chrono::duration_cast<std::chrono::milliseconds>(ackTimeout).count());
+            }
+
+            pending_t pending;
+
+            pending.payload.move(&payload);
+            pending.header = header;
+
+            transmit(pending);
+
+            inFlight.push_back(std::move(pending));
+        }
+
+        // Waits until every message is acknowledged, false on timeout
+        bool flush(int timeoutMs)
+        {
+            clock::time_point deadline = clock::now() + std::chrono::milliseconds(timeoutMs);
+
+            while (outstanding() > 0)
+            {
+                clock::time_point now = clock::now();
+
+                if (now >= deadline)
+                {
+                    return false;
+                }
+
+                poll(std::min(100L, (long) std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1));
+            }
+
+            return true;
+        }
+
+        size_t outstanding() const
+        {
+            return inFlight.size() + retries.size();
+        }
+
+        // Processes acks and resends what is due, waits up to timeoutMs for the broker
+        void poll(long timeoutMs)
+        {
+            zmq::pollitem_t items[] = {{socket, 0, ZMQ_POLLIN, 0}};
+
+            zmq::poll(items, 1, std::min(timeoutMs, nextTimeout()));
+
+            receiveAcks();
+            resend();
+        }
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct pending_t
+        {
+            uint64_t          seq;
+            clock::time_point sent;
+            zmq::message_t    payload;
+            std::string       header;
+        };
+
+        zmq::context_t ctx;
+        zmq::socket_t  socket;
+
+        uint64_t              nextSeq;
+        std::deque<pending_t> inFlight; // ordered by seq
+        std::deque<pending_t> retries;  // ordered by rejection time
+
+        size_t                    window;
+        std::chrono::milliseconds ackTimeout;
+        std::chrono::milliseconds retryDelay;
+        reject_handler_t          rejectHandler;
+
+        void transmit(pending_t &pending)
+        {
+            zmq::message_t seq(SEQ_SIZE);
+            zmq::message_t payload;
+
+            pending.seq = nextSeq++;
+            pending.sent = clock::now();
+
+            encodeSeq(pending.seq, seq.data());
+
+            // zmq_msg_copy shares the buffer, the original stays here until acknowledged
+            payload.copy(&pending.payload);
+
+            socket.send(seq, ZMQ_SNDMORE);
+
+            if (!pending.header.empty())
+            {
+                zmq::message_t header(pending.header.size());
+
+                memcpy(header.data(), pending.header.data(), pending.header.size());
+
+                socket.send(header, ZMQ_SNDMORE);
+            }
+
+            socket.send(payload);
+        }
+
+        void receiveAcks()
+        {
+            zmq::message_t ack;
+
+            while (socket.recv(&ack, ZMQ_DONTWAIT))
+            {
+                const char *data = static_cast<const char *>(ack.data());
+
+                if (ack.size() == 1 + SEQ_SIZE && data[0] == ACK_ACCEPTED)
+                {
+                    uint64_t seq = decodeSeq(data + 1);
+
+                    while (!inFlight.empty() && inFlight.front().seq <= seq)
+                    {
+                        inFlight.pop_front();
+                    }
+                }
+                else if (ack.size() == 1 + 2 * SEQ_SIZE && data[0] == ACK_REJECTED)
+                {
+                    rejected(decodeSeq(data + 1), decodeSeq(data + 1 + SEQ_SIZE));
+                }
+            }
+        }
+
+        void rejected(uint64_t first, uint64_t last)
+        {
+            clock::time_point now = clock::now();
+
+            for (std::deque<pending_t>::iterator it = inFlight.begin(); it != inFlight.end();)
+            {
+                if (it->seq < first || it->seq > last)
+                {
+                    it++;
+
+                    continue;
+                }
+
+                if (rejectHandler)
+                {
+                    payload_view view = {static_cast<const char *>(it->payload.data()), it->payload.size()};
+
+                    rejectHandler(view);
+                }
+                else
+                {
+                    it->sent = now;
+
+                    retries.push_back(std::move(*it));
+                }
+
+                it = inFlight.erase(it);
+            }
+        }
+
+        void resend()
+        {
+            clock::time_point now = clock::now();
+
+            // new seqs keep inFlight ordered
+            while (!inFlight.empty() && now - inFlight.front().sent >= ackTimeout)
+            {
+                pending_t pending = std::move(inFlight.front());
+
+                inFlight.pop_front();
+
+                transmit(pending);
+
+                inFlight.push_back(std::move(pending));
+            }
+
+            while (!retries.empty() && now - retries.front().sent >= retryDelay)
+            {
+                pending_t pending = std::move(retries.front());
+
+                retries.pop_front();
+
+                transmit(pending);
+
+                inFlight.push_back(std::move(pending));
+            }
+        }
+
+        long nextTimeout()
+        {
+            clock::time_point now      = clock::now();
+            clock::time_point deadline = now + ackTimeout;
+
+            if (!inFlight.empty())
+            {
+                deadline = std::min(deadline, inFlight.front().sent + ackTimeout);
+            }
+
+            if (!retries.empty())
+            {
+                deadline = std::min(deadline, retries.front().sent + retryDelay);
+            }
+
+            return deadline <= now ? 0 : std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        }
+    };
+}
+
+#endif //SERVICE_QUEUE_CLIENT_PRODUCER_H
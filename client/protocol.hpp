@@ -0,0 +1,97 @@
+#ifndef SERVICE_QUEUE_CLIENT_PROTOCOL_H
+#define SERVICE_QUEUE_CLIENT_PROTOCOL_H
+
+#include <zmq.hpp>
+#include <string>
+#include <cstring>
+#include <stdint.h>
+
+#define CONTROL_PREFIX "{\"action\":\""
+#define CONTROL_SUFFIX "\",\"history\":[],\"issuer\":\"service_queue\",\"data\":[],\"sections\":{}}"
+
+// Acknowledged input: producer sends [seq][payload], broker answers with
+// [ACK_ACCEPTED][seq] - every seq up to this one which was not rejected is accepted (sent in batches),
+// [ACK_REJECTED][first][last] - this range is rejected (shed, or lost in transit) and should be sent again.
+#define ACK_ACCEPTED 'A'
+#define ACK_REJECTED 'N'
+
+#define SEQ_SIZE 8
+
+namespace service_queue
+{
+    // Control message sent by the broker to a worker over output (ping, shutdown)
+    inline std::string controlMessage(const std::string &action)
+    {
+        return CONTROL_PREFIX + action + CONTROL_SUFFIX;
+    }
+
+    // Control messages are generated by controlMessage() only, so comparing the whole frame is enough
+    inline bool isControlMessage(const zmq::message_t &message, const char *action)
+    {
+        const char *data       = static_cast<const char *>(message.data());
+        size_t      prefixSize = sizeof(CONTROL_PREFIX) - 1;
+        size_t      suffixSize = sizeof(CONTROL_SUFFIX) - 1;
+        size_t      actionSize = strlen(action);
+
+        return message.size() == prefixSize + actionSize + suffixSize
+            && 0 == memcmp(data, CONTROL_PREFIX, prefixSize)
+            && 0 == memcmp(data + prefixSize, action, actionSize)
+            && 0 == memcmp(data + prefixSize + actionSize, CONTROL_SUFFIX, suffixSize);
+    }
+
+    // Value for a JSON string, the quotes are not added
+    inline std::string jsonEscape(const std::string &value)
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::string       escaped;
+
+        for (size_t i = 0; i < value.size(); i++)
+        {
+            unsigned char c = value[i];
+
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if (c < 0x20)
+            {
+                escaped += "\\u00";
+                escaped += hex[c >> 4];
+                escaped += hex[c & 0xf];
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+
+        return escaped;
+    }
+
+    inline void encodeSeq(uint64_t seq, void *buffer)
+    {
+        unsigned char *bytes = static_cast<unsigned char *>(buffer);
+
+        for (int i = SEQ_SIZE - 1; i >= 0; i--)
+        {
+            bytes[i] = seq & 0xff;
+            seq >>= 8;
+        }
+    }
+
+    inline uint64_t decodeSeq(const void *buffer)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(buffer);
+        uint64_t             seq   = 0;
+
+        for (int i = 0; i < SEQ_SIZE; i++)
+        {
+            seq = (seq << 8) | bytes[i];
+        }
+
+        return seq;
+    }
+}
+
+#endif //SERVICE_QUEUE_CLIENT_PROTOCOL_H
@@ -0,0 +1,604 @@
+#ifndef SERVICE_QUEUE_CLIENT_WORKER_H
+#define SERVICE_QUEUE_CLIENT_WORKER_H
+
+#include "protocol.hpp"
+#include "codec.hpp"
+#include "payload.hpp"
+#include "../shm_ring.hpp"
+#include <zmq.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace service_queue
+{
+    // Worker side of the service_queue protocol.
+    //
+    // Sockets are owned by an I/O thread which answers pings right away and registers again with backoff
+    // when the broker goes silent, so a long running handler never misses a heartbeat.
+    // Jobs are passed to the thread calling run() over inproc without copying the payload.
+    class worker
+    {
+    public:
+        typedef std::function<void (const payload_view &)> handler_t;
+
+        // header is the JSON the producer sent with the chunk ("stream", "chunk", "last")
+        typedef std::function<void (const payload_view &header, const payload_view &chunk)> chunk_handler_t;
+
+        worker(const std::string &outputDSN, const std::string &serviceDSN, const std::string &identity = "")
+            : ctx(1), outputDSN(outputDSN), serviceDSN(serviceDSN), identity(identity),
+              credit(0), batch(false), heartbeatTimeout(70), stopOnShutdown(true), sharedMemory(0), compression(false),
+              stopping(false)
+        {
+            // set by the broker's supervisor for the workers it starts, so it can tell them apart
+            const char *assigned = getenv("SERVICE_QUEUE_WORKER_ID");
+
+            if (worker::identity.empty() && assigned != NULL)
+            {
+                worker::identity = assigned;
+            }
+
+            if (worker::identity.empty())
+            {
+                char host[256] = {0};
+
+                gethostname(host, sizeof(host) - 1);
+
+                std::stringstream ss;
+
+                ss << "worker-" << host << "-" << getpid();
+
+                worker::identity = ss.str();
+            }
+
+            std::stringstream ss;
+
+            ss << "inproc://service_queue.worker." << this;
+
+            pipeDSN = ss.str();
+        }
+
+        // Max messages in flight; with credit set every finished message is reported with "done"
+        void setCredit(unsigned int credit)
+        {
+            worker::credit = credit;
+        }
+
+        // Accept several payloads in one delivery, the handler is still called once per payload
+        void setBatch(bool batch)
+        {
+            worker::batch = batch;
+        }
+
+        // Register again when no ping arrived for this long, broker pings every 30 seconds
+        void setHeartbeatTimeout(int seconds)
+        {
+            heartbeatTimeout = seconds;
+        }
+
+        // By default "shutdown" from the broker makes run() return, otherwise the worker registers again
+        void setStopOnShutdown(bool stop)
+        {
+            stopOnShutdown = stop;
+        }
+
+        // Receive payloads through a shared memory ring of this many bytes when the broker runs on the same host,
+        // the socket is still used for control messages and whatever does not fit into the ring
+        void setSharedMemory(size_t bytes)
+        {
+            sharedMemory = bytes;
+        }
+
+        // Ask for large payloads compressed with a codec this worker is built with (-DSERVICE_QUEUE_LZ4 and liblz4,
+        // -DSERVICE_QUEUE_ZSTD and libzstd); the broker compresses only for workers on other hosts
+        void setCompression(bool compression)
+        {
+            worker::compression = compression;
+        }
+
+        // Take chunked streams as well: every chunk of a stream comes to this worker and goes to the handler,
+        // chunks sent again by the producer may come late or twice, so put them together by "chunk"
+        void setStreamHandler(chunk_handler_t handler)
+        {
+            streamHandler = handler;
+        }
+
+        const std::string &getIdentity() const
+        {
+            return identity;
+        }
+
+        // Blocks until the broker sends shutdown or stop() is called
+        void run(handler_t handler)
+        {
+            zmq::socket_t pipe(ctx, ZMQ_PAIR);
+
+            pipe.bind(pipeDSN.c_str());
+
+            stopping = false;
+
+            if (sharedMemory > 0)
+            {
+                std::string name = "/service_queue." + identity;
+
+                std::replace(name.begin() + 1, name.end(), '/', '_');
+
+                // without the ring everything simply arrives over the socket
+                ring.reset(shm_ring::create(name, sharedMemory));
+            }
+
+            std::thread io(&worker::io, this);
+
+            try
+            {
+                while (true)
+                {
+                    zmq::message_t type;
+
+                    if (ring)
+                    {
+                        uint32_t count = readRing(handler);
+
+                        sendDone(pipe, count);
+
+                        if (!pipe.recv(&type, ZMQ_DONTWAIT))
+                        {
+                            if (count == 0)
+                            {
+                                // the broker and the I/O thread both wake the ring futex, so one wait covers both channels
+                                uint32_t signal = ring->prepareWait();
+
+                                if (ring->empty() && !readable(pipe))
+                                {
+                                    ring->wait(signal, RING_WAIT_MS);
+                                }
+                                else
+                                {
+                                    ring->finishWait();
+                                }
+                            }
+
+                            continue;
+                        }
+                    }
+                    else
+                    {
+                        pipe.recv(&type);
+                    }
+
+                    if (*static_cast<const char *>(type.data()) == PIPE_STOP)
+                    {
+                        break;
+                    }
+
+                    zmq::message_t frame;
+
+                    pipe.recv(&frame);
+
+                    // [chunk marker][header][chunk], a single job for the broker's credit
+                    if (frame.more() && isControlMessage(frame, "chunk"))
+                    {
+                        zmq::message_t header;
+                        zmq::message_t chunk;
+
+                        pipe.recv(&header);
+                        pipe.recv(&chunk);
+
+                        payload_view headerView = {static_cast<const char *>(header.data()), header.size()};
+                        payload_view chunkView  = {static_cast<const char *>(chunk.data()), chunk.size()};
+
+                        if (streamHandler)
+                        {
+                            streamHandler(headerView, chunkView);
+                        }
+
+                        sendDone(pipe, 1);
+
+                        continue;
+                    }
+
+                    codec_t codec = frame.more() ? codecOfMarker(frame) : CODEC_NONE;
+
+                    // [codec marker][original size][compressed payload], a single payload
+                    if (codec != CODEC_NONE)
+                    {
+                        zmq::message_t compressed;
+
+                        pipe.recv(&compressed);
+
+                        if (!decompressPayload(codec, compressed.data(), compressed.size(), inflated))
+                        {
+                            throw std::runtime_error(std::string("service_queue: corrupt ") + codecName(codec) + " payload");
+                        }
+
+                        payload_view view = {inflated.data(), inflated.size()};
+
+                        handler(view);
+
+                        sendDone(pipe, 1);
+
+                        continue;
+                    }
+
+                    uint32_t count = 0;
+
+                    while (true)
+                    {
+                        bool more = frame.more();
+
+                        payload_view view = {static_cast<const char *>(frame.data()), frame.size()};
+
+                        handler(view);
+
+                        count++;
+
+                        if (!more)
+                        {
+                            break;
+                        }
+
+                        pipe.recv(&frame);
+                    }
+
+                    sendDone(pipe, count);
+                }
+            }
+            catch (...)
+            {
+                stop();
+                io.join();
+
+                ring.reset();
+
+                throw;
+            }
+
+            io.join();
+
+            ring.reset();
+        }
+
+        // Safe to call from any thread, run() returns shortly after
+        void stop()
+        {
+            stopping = true;
+        }
+
+    private:
+        static const char PIPE_JOB  = 'J';
+        static const char PIPE_STOP = 'S';
+        static const char PIPE_DONE = 'D';
+
+        static const int MAX_BACKOFF  = 30;
+        static const int RING_WAIT_MS = 100;
+        static const int RING_BURST   = 256;
+
+        zmq::context_t ctx;
+
+        std::string outputDSN;
+        std::string serviceDSN;
+        std::string pipeDSN;
+        std::string identity;
+
+        unsigned int credit;
+        bool         batch;
+        int          heartbeatTimeout;
+        bool         stopOnShutdown;
+        size_t       sharedMemory;
+        bool         compression;
+
+        std::string inflated; // decompressed payload, reused
+
+        std::unique_ptr<shm_ring> ring;
+
+        chunk_handler_t streamHandler;
+
+        std::atomic<bool> stopping;
+
+        uint32_t readRing(handler_t &handler)
+        {
+            uint32_t     count = 0;
+            payload_view view;
+
+            // bounded, so jobs and stop arriving over the pipe are not starved
+            while (count < RING_BURST && ring->peek(view.data, view.size))
+            {
+                handler(view);
+
+                ring->release();
+
+                count++;
+            }
+
+            return count;
+        }
+
+        static bool readable(zmq::socket_t &socket)
+        {
+            int    events      = 0;
+            size_t events_size = sizeof(events);
+
+            socket.getsockopt(ZMQ_EVENTS, &events, &events_size);
+
+            return events & ZMQ_POLLIN;
+        }
+
+        void sendDone(zmq::socket_t &pipe, uint32_t count)
+        {
+            if (credit == 0 || count == 0)
+            {
+                return;
+            }
+
+            zmq::message_t done(1 + sizeof(count));
+
+            *static_cast<char *>(done.data()) = PIPE_DONE;
+            memcpy(static_cast<char *>(done.data()) + 1, &count, sizeof(count));
+
+            pipe.send(done);
+        }
+
+        zmq::socket_t *open(int type, const std::string &dsn)
+        {
+            zmq::socket_t *socket = new zmq::socket_t(ctx, type);
+
+            int linger       = 0;
+            int reconnect    = 100;
+            int reconnectMax = MAX_BACKOFF * 1000;
+
+            socket->setsockopt(ZMQ_IDENTITY, identity.data(), identity.size());
+            socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+            socket->setsockopt(ZMQ_RECONNECT_IVL, &reconnect, sizeof(reconnect));
+            socket->setsockopt(ZMQ_RECONNECT_IVL_MAX, &reconnectMax, sizeof(reconnectMax));
+            socket->connect(dsn.c_str());
+
+            return socket;
+        }
+
+        static void sendService(zmq::socket_t *service, const std::string &data)
+        {
+            zmq::message_t delimiter(0);
+            zmq::message_t message(data.size());
+
+            memcpy(message.data(), data.data(), data.size());
+
+            service->send(delimiter, ZMQ_SNDMORE);
+            service->send(message);
+        }
+
+        void registerWorker(zmq::socket_t *service)
+        {
+            std::stringstream ss;
+
+            // tells the broker which of its outputs we are on, so it can prefer cheaper transports
+            ss << "{\"action\":\"service.register\",\"output\":\"" << outputDSN << "\"";
+
+            if (credit > 0)
+            {
+                ss << ",\"credit\":" << credit;
+            }
+
+            if (batch)
+            {
+                ss << ",\"batch\":true";
+            }
+
+            if (streamHandler)
+            {
+                ss << ",\"streams\":true";
+            }
+
+            if (compression && availableCodecs() != "[]")
+            {
+                ss << ",\"compression\":" << availableCodecs();
+            }
+
+            if (ring)
+            {
+                char host[256] = {0};
+
+                gethostname(host, sizeof(host) - 1);
+
+                ss << ",\"shm\":\"" << ring->getName() << "\",\"host\":\"" << host << "\"";
+            }
+
+            ss << "}";
+
+            sendService(service, ss.str());
+        }
+
+        static bool signal(zmq::socket_t &pipe, char type, int flags = 0)
+        {
+            zmq::message_t message(1);
+
+            *static_cast<char *>(message.data()) = type;
+
+            return pipe.send(message, flags);
+        }
+
+        // false when the handler thread has no room for it, the pipe's HWM is checked on the first frame only
+        static bool forward(zmq::socket_t &pipe, std::vector<zmq::message_t> &job)
+        {
+            if (!signal(pipe, PIPE_JOB, ZMQ_SNDMORE | ZMQ_DONTWAIT))
+            {
+                return false;
+            }
+
+            for (size_t i = 0; i < job.size(); i++)
+            {
+                pipe.send(job[i], i + 1 < job.size() ? ZMQ_SNDMORE : 0);
+            }
+
+            return true;
+        }
+
+        void wakeRunner()
+        {
+            if (ring)
+            {
+                ring->notify();
+            }
+        }
+
+        void io()
+        {
+            typedef std::chrono::steady_clock clock;
+
+            zmq::socket_t pipe(ctx, ZMQ_PAIR);
+
+            pipe.connect(pipeDSN.c_str());
+
+            zmq::socket_t *output  = open(ZMQ_DEALER, outputDSN);
+            zmq::socket_t *service = open(ZMQ_DEALER, serviceDSN);
+
+            registerWorker(service);
+
+            clock::time_point lastPing     = clock::now();
+            clock::time_point nextRegister = lastPing;
+            int               backoff      = 1;
+
+            // jobs the handler thread has no room for yet; output is not read meanwhile, so the broker's
+            // queue fills up instead of this one, and the loop never blocks on the pipe
+            std::deque<std::vector<zmq::message_t> > parked;
+
+            while (true)
+            {
+                short outputEvents = parked.empty() ? ZMQ_POLLIN : 0;
+                short pipeEvents   = parked.empty() ? ZMQ_POLLIN : ZMQ_POLLIN | ZMQ_POLLOUT;
+
+                zmq::pollitem_t items[] = {{*output, 0, outputEvents, 0}, {pipe, 0, pipeEvents, 0}};
+
+                zmq::poll(items, 2, 100);
+
+                if (items[0].revents & ZMQ_POLLIN)
+                {
+                    zmq::message_t first;
+
+                    output->recv(&first);
+
+                    if (!first.more() && isControlMessage(first, "ping"))
+                    {
+                        sendService(service, "{\"action\":\"pong\"}");
+
+                        lastPing = clock::now();
+                        backoff = 1;
+                    }
+                    else if (!first.more() && isControlMessage(first, "shutdown"))
+                    {
+                        if (stopOnShutdown)
+                        {
+                            break;
+                        }
+
+                        // dropped by the broker, make the timeout below register us again
+                        lastPing = clock::now() - std::chrono::seconds(heartbeatTimeout);
+                    }
+                    else
+                    {
+                        std::vector<zmq::message_t> job;
+
+                        bool more = first.more();
+
+                        job.push_back(std::move(first));
+
+                        while (more)
+                        {
+                            zmq::message_t frame;
+
+                            output->recv(&frame);
+
+                            more = frame.more();
+
+                            job.push_back(std::move(frame));
+                        }
+
+                        if (forward(pipe, job))
+                        {
+                            wakeRunner();
+                        }
+                        else
+                        {
+                            parked.push_back(std::move(job));
+                        }
+                    }
+                }
+
+                if (items[1].revents & ZMQ_POLLOUT)
+                {
+                    while (!parked.empty() && forward(pipe, parked.front()))
+                    {
+                        parked.pop_front();
+                    }
+
+                    wakeRunner();
+                }
+
+                if (items[1].revents & ZMQ_POLLIN)
+                {
+                    zmq::message_t message;
+                    uint32_t       count;
+
+                    pipe.recv(&message);
+
+                    memcpy(&count, static_cast<const char *>(message.data()) + 1, sizeof(count));
+
+                    std::stringstream ss;
+
+                    ss << "{\"action\":\"done\",\"count\":" << count << "}";
+
+                    sendService(service, ss.str());
+                }
+
+                if (stopping)
+                {
+                    sendService(service, "{\"action\":\"service.shutdown\"}");
+
+                    break;
+                }
+
+                clock::time_point now = clock::now();
+
+                if (now - lastPing >= std::chrono::seconds(heartbeatTimeout) && now >= nextRegister)
+                {
+                    // fresh sockets drop whatever was queued for the broker we lost
+                    output->close();
+                    service->close();
+
+                    delete output;
+                    delete service;
+
+                    output = open(ZMQ_DEALER, outputDSN);
+                    service = open(ZMQ_DEALER, serviceDSN);
+
+                    registerWorker(service);
+
+                    nextRegister = now + std::chrono::seconds(backoff);
+                    backoff = std::min(backoff * 2, (int) MAX_BACKOFF);
+                }
+            }
+
+            signal(pipe, PIPE_STOP);
+
+            wakeRunner();
+
+            output->close();
+            service->close();
+
+            delete output;
+            delete service;
+        }
+    };
+}
+
+#endif //SERVICE_QUEUE_CLIENT_WORKER_H
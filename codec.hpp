@@ -0,0 +1,73 @@
+#ifndef SERVICE_QUEUE_CODEC_H
+#define SERVICE_QUEUE_CODEC_H
+
+#include "protocol.hpp"
+#include "slice.hpp"
+#include "client/codec.hpp"
+#include <string>
+
+using namespace std;
+
+// shared with the client library, which keeps them in its namespace
+using service_queue::codec_t;
+using service_queue::CODEC_NONE;
+using service_queue::CODEC_LZ4;
+using service_queue::CODEC_ZSTD;
+using service_queue::codecName;
+using service_queue::codecAvailable;
+using service_queue::codecMarker;
+using service_queue::availableCodecs;
+using service_queue::compressBound;
+using service_queue::compressPayload;
+
+// Built in codec of this name, CODEC_NONE otherwise
+inline codec_t codecByName(const slice_t &name)
+{
+    for (int codec = CODEC_NONE + 1; codec < CODEC_COUNT; codec++)
+    {
+        if (name == codecName((codec_t) codec) && codecAvailable((codec_t) codec))
+        {
+            return (codec_t) codec;
+        }
+    }
+
+    return CODEC_NONE;
+}
+
+// First built in codec of what a worker offers, a name or an array of names in its order of preference
+inline codec_t negotiateCodec(const slice_t &offered)
+{
+    const char *p   = offered.data;
+    const char *end = offered.data + offered.size;
+
+    // a string value comes without its quotes
+    if (p < end && *p != '[')
+    {
+        return codecByName(offered);
+    }
+
+    while (p < end)
+    {
+        const char *start = (const char *) memchr(p, '"', end - p);
+        const char *stop  = start != NULL ? (const char *) memchr(start + 1, '"', end - start - 1) : NULL;
+
+        if (stop == NULL)
+        {
+            break;
+        }
+
+        slice_t name  = {start + 1, (size_t) (stop - start - 1)};
+        codec_t codec = codecByName(name);
+
+        if (codec != CODEC_NONE)
+        {
+            return codec;
+        }
+
+        p = stop + 1;
+    }
+
+    return CODEC_NONE;
+}
+
+#endif //SERVICE_QUEUE_CODEC_H
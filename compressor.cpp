@@ -0,0 +1,204 @@
+#include "compressor.hpp"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static uint64_t threadCpuUs()
+{
+    timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+compressor::compressor()
+    : stopping(false), wakeFd(-1), level(1), maxRatio(0.9)
+{
+    memset(&totals, 0, sizeof(totals));
+}
+
+compressor::~compressor()
+{
+    stop();
+}
+
+void compressor::configure(int level, double maxRatio)
+{
+    lock_guard<mutex> guard(lock);
+
+    compressor::level = level;
+    compressor::maxRatio = maxRatio;
+}
+
+void compressor::start(size_t count, int wakeFd)
+{
+    if (running())
+    {
+        return;
+    }
+
+    compressor::wakeFd = wakeFd;
+    stopping = false;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        threads.push_back(thread(&compressor::run, this));
+    }
+}
+
+void compressor::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+
+        stopping = true;
+    }
+
+    available.notify_all();
+
+    for (vector<thread>::iterator it = threads.begin(); it < threads.end(); it++)
+    {
+        (*it).join();
+    }
+
+    threads.clear();
+}
+
+void compressor::submit(compression_job_t &job)
+{
+    bool compress = job.compress;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        job.done = !compress;
+
+        submitted.push_back(move(job));
+
+        if (compress)
+        {
+            jobs.push_back(&submitted.back());
+        }
+    }
+
+    // one that is done already is collected by the broker's next pass anyway
+    if (compress)
+    {
+        available.notify_one();
+    }
+}
+
+void compressor::collect(deque<compression_job_t> &done)
+{
+    lock_guard<mutex> guard(lock);
+
+    while (!submitted.empty() && submitted.front().done)
+    {
+        done.push_back(move(submitted.front()));
+
+        submitted.pop_front();
+    }
+}
+
+size_t compressor::pending()
+{
+    lock_guard<mutex> guard(lock);
+
+    return submitted.size();
+}
+
+compression_stats_t compressor::statistics()
+{
+    lock_guard<mutex> guard(lock);
+
+    return totals;
+}
+
+void compressor::run()
+{
+    // grows to the largest payload seen by this thread
+    vector<char>       buffer;
+    unique_lock<mutex> guard(lock);
+
+    while (true)
+    {
+        while (!stopping && jobs.empty())
+        {
+            available.wait(guard);
+        }
+
+        // stop() still gets everything handed over before it compressed
+        if (jobs.empty())
+        {
+            break;
+        }
+
+        // stays in submitted, only this thread touches it until it is done
+        compression_job_t &job = *jobs.front();
+
+        jobs.pop_front();
+
+        int    level    = compressor::level;
+        double maxRatio = compressor::maxRatio;
+
+        guard.unlock();
+
+        uint64_t started = threadCpuUs();
+        size_t   size    = job.payload.size();
+        size_t   bound   = compressBound(job.codec, size);
+        size_t   written = 0;
+
+        if (bound > 0)
+        {
+            if (buffer.size() < bound)
+            {
+                buffer.resize(bound);
+            }
+
+            written = compressPayload(job.codec, level, job.payload.data(), size, &buffer[0], bound);
+        }
+
+        bool useful = written > 0 && written <= size * maxRatio;
+
+        if (useful)
+        {
+            job.compressed.rebuild(written);
+            memcpy(job.compressed.data(), &buffer[0], written);
+        }
+
+        uint64_t cpu = threadCpuUs() - started;
+
+        guard.lock();
+
+        job.done = true;
+
+        totals.cpuUs += cpu;
+
+        if (useful)
+        {
+            totals.compressed++;
+            totals.bytesIn += size;
+            totals.bytesOut += written;
+        }
+        else
+        {
+            totals.skipped++;
+        }
+
+        // a job behind the oldest one waits for it, whoever finishes the oldest wakes the broker
+        bool wake = &submitted.front() == &job;
+
+        if (wake && wakeFd >= 0)
+        {
+            unsigned char number = COMPRESSOR_WAKEUP;
+
+            if (write(wakeFd, &number, 1) < 0)
+            {
+                // pipe is full, a wakeup is pending anyway
+            }
+        }
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef SERVICE_QUEUE_COMPRESSOR_H
+#define SERVICE_QUEUE_COMPRESSOR_H
+
+#include "codec.hpp"
+#include "zmq.hpp"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+#define COMPRESSOR_WAKEUP 0 // written to the broker's wakeup pipe when jobs are done, no signal has number 0
+
+typedef struct
+{
+    string         worker;
+    codec_t        codec;
+    zmq::message_t payload;    // the original, kept in flight and for dead letters
+    zmq::message_t compressed; // [original size][compressed payload], empty - send the payload as it is
+    uint32_t       trace;
+    bool           compress;   // false - only keeps its place behind earlier payloads for the same worker
+    bool           input;      // came from the input, may go to another worker if this one is gone
+    bool           done;
+} compression_job_t;
+
+typedef struct
+{
+    uint64_t compressed; // payloads that are sent compressed
+    uint64_t skipped;    // did not compress well enough, sent as they are
+    uint64_t bytesIn;    // of the compressed ones
+    uint64_t bytesOut;
+    uint64_t cpuUs;      // thread CPU time spent compressing, skipped payloads included
+} compression_stats_t;
+
+// Compresses payloads for workers on other hosts on a few threads of its own, so the poll loop only hands jobs
+// over and sends what is finished. A payload that does not get below maxRatio of its size is sent as it is.
+// Jobs are collected in the order they were submitted, so a payload never overtakes an earlier one; the broker
+// is woken through its wakeup pipe when the oldest job is done.
+class compressor
+{
+
+private:
+    vector<thread>             threads;
+    mutex                      lock;
+    condition_variable         available;
+    deque<compression_job_t>   submitted; // in order until collected, deque keeps the elements in place
+    deque<compression_job_t *> jobs;      // waiting for a thread
+    bool                       stopping;
+    int                        wakeFd;
+
+    int    level;
+    double maxRatio;
+
+    compression_stats_t totals;
+
+    void run();
+
+public:
+    compressor();
+
+    ~compressor();
+
+    void configure(int level, double maxRatio);
+
+    // Threads are started once, 0 - compression stays off
+    void start(size_t count, int wakeFd);
+
+    // Finishes the jobs handed over so far and joins the threads
+    void stop();
+
+    bool running() const
+    {
+        return !threads.empty();
+    }
+
+    void submit(compression_job_t &job);
+
+    // Moves the jobs that are done and not behind one still compressing to done
+    void collect(deque<compression_job_t> &done);
+
+    // Handed over and not collected yet
+    size_t pending();
+
+    compression_stats_t statistics();
+};
+
+#endif //SERVICE_QUEUE_COMPRESSOR_H
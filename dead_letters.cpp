@@ -0,0 +1,207 @@
+#include "dead_letters.hpp"
+#include "main.hpp"
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <utility>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+dead_letter_store::dead_letter_store()
+    : segmentSize(0), log(NULL), index(NULL), offset(0), lost(0)
+{
+}
+
+bool dead_letter_store::open(const string &directory, size_t segmentSize)
+{
+    dead_letter_store::directory = directory;
+    dead_letter_store::segmentSize = segmentSize;
+
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        ERR << "Dead letters: " << directory << ": " << strerror(errno);
+
+        return false;
+    }
+
+    if (!openSegment(chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count()))
+    {
+        return false;
+    }
+
+    LOG << "Dead letters: " << directory;
+
+    return true;
+}
+
+bool dead_letter_store::openSegment(uint64_t time)
+{
+    stringstream name;
+
+    name << directory << "/" << setw(20) << setfill('0') << time;
+
+    log = fopen((name.str() + DEAD_LETTER_LOG_SUFFIX).c_str(), "wb");
+    index = fopen((name.str() + DEAD_LETTER_IDX_SUFFIX).c_str(), "wb");
+
+    if (log == NULL || index == NULL)
+    {
+        ERR << "Dead letters: " << name.str() << ": " << strerror(errno);
+
+        closeSegment();
+
+        return false;
+    }
+
+    // written out by flush() on the broker timer, not per message
+    setvbuf(log, NULL, _IOFBF, 1 << 20);
+
+    offset = 0;
+
+    return true;
+}
+
+void dead_letter_store::closeSegment()
+{
+    if (log != NULL && index != NULL)
+    {
+        writeIndex();
+    }
+
+    if (log != NULL)
+    {
+        fclose(log);
+    }
+
+    if (index != NULL)
+    {
+        fclose(index);
+    }
+
+    log = NULL;
+    index = NULL;
+}
+
+// Flushes the log, then writes the entries of what made it to disk
+void dead_letter_store::writeIndex()
+{
+    if (fflush(log) != 0)
+    {
+        ERR << "Dead letters: log flush failed, " << unindexed.size() << " records lost: " << strerror(errno);
+
+        lost += unindexed.size();
+
+        resync();
+    }
+    else if (!unindexed.empty() && fwrite(&unindexed[0], sizeof(dead_letter_index_t), unindexed.size(), index) != unindexed.size())
+    {
+        ERR << "Dead letters: index write failed, " << unindexed.size() << " records lost: " << strerror(errno);
+
+        lost += unindexed.size();
+    }
+    else if (fflush(index) != 0)
+    {
+        ERR << "Dead letters: index flush failed: " << strerror(errno);
+    }
+
+    unindexed.clear();
+}
+
+// After a failed write the stream may have kept less than it took, the file position is what the next record follows
+void dead_letter_store::resync()
+{
+    clearerr(log);
+
+    long position = ftell(log);
+
+    if (position >= 0)
+    {
+        offset = position;
+    }
+}
+
+size_t dead_letter_store::close()
+{
+    closeSegment();
+
+    directory.clear();
+
+    size_t count = lost;
+
+    lost = 0;
+
+    return count;
+}
+
+void dead_letter_store::swap(dead_letter_store &other)
+{
+    std::swap(directory, other.directory);
+    std::swap(segmentSize, other.segmentSize);
+    std::swap(log, other.log);
+    std::swap(index, other.index);
+    std::swap(offset, other.offset);
+    std::swap(unindexed, other.unindexed);
+    std::swap(lost, other.lost);
+}
+
+bool dead_letter_store::append(const string &worker, const zmq::message_t &payload, dead_reason_t reason)
+{
+    if (log == NULL)
+    {
+        return false;
+    }
+
+    uint64_t time = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+    if (offset >= segmentSize)
+    {
+        closeSegment();
+
+        if (!openSegment(time))
+        {
+            ERR << "Dead letters: cannot start a new segment, writing stopped until the store is configured again";
+
+            return false;
+        }
+    }
+
+    dead_letter_header_t header = {time, (uint32_t) payload.size(), (uint16_t) worker.size(), (uint8_t) reason, 0};
+    dead_letter_index_t  entry  = {time, offset, deadLetterHash(worker.data(), worker.size()), (uint32_t) payload.size()};
+
+    size_t written = fwrite(&header, 1, sizeof(header), log);
+
+    written += fwrite(worker.data(), 1, worker.size(), log);
+    written += fwrite(payload.data(), 1, payload.size(), log);
+
+    // what did get written still takes its place in the log, the next record starts after it
+    offset += written;
+
+    if (written != sizeof(header) + worker.size() + payload.size())
+    {
+        ERR << "Dead letters: write failed: " << strerror(errno);
+
+        resync();
+
+        return false;
+    }
+
+    unindexed.push_back(entry);
+
+    return true;
+}
+
+size_t dead_letter_store::flush()
+{
+    if (log != NULL)
+    {
+        writeIndex();
+    }
+
+    size_t count = lost;
+
+    lost = 0;
+
+    return count;
+}
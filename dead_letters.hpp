@@ -0,0 +1,115 @@
+#ifndef SERVICE_QUEUE_DEAD_LETTERS_H
+#define SERVICE_QUEUE_DEAD_LETTERS_H
+
+#include "zmq.hpp"
+#include "fnv.hpp"
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace std;
+
+// On-disk layout, shared with service_queue_replay.
+//
+// The store is a directory of segments named by the time of their first record (microseconds since epoch):
+// <time>.log holds records [dead_letter_header_t][worker identity][payload], <time>.idx holds one
+// dead_letter_index_t per record in the same order, so a time range is found by binary search on the index
+// and records of other workers are skipped without touching the log.
+
+#define DEAD_LETTER_LOG_SUFFIX ".log"
+#define DEAD_LETTER_IDX_SUFFIX ".idx"
+
+typedef enum
+{
+    DEAD_SEND_FAILED = 1, // worker gone or its queue full when sending
+    DEAD_WORKER_LOST = 2, // in flight to a worker that timed out or unregistered
+    DEAD_NOT_DUE     = 3  // delayed and not due yet when the broker stopped
+} dead_reason_t;
+
+typedef struct
+{
+    uint64_t time;       // microseconds since epoch
+    uint32_t size;       // payload
+    uint16_t workerSize;
+    uint8_t  reason;
+    uint8_t  reserved;
+} dead_letter_header_t;
+
+typedef struct
+{
+    uint64_t time;
+    uint64_t offset; // of the record header in the log
+    uint32_t worker; // deadLetterHash() of the worker identity
+    uint32_t size;   // payload
+} dead_letter_index_t;
+
+inline uint32_t deadLetterHash(const char *data, size_t size)
+{
+    return (uint32_t) fnv1a64(data, size);
+}
+
+class dead_letter_store
+{
+
+private:
+    string directory;
+    size_t segmentSize;
+
+    FILE    *log;
+    FILE    *index;
+    uint64_t offset; // bytes written to the log, a failed record included
+
+    // entries whose records are not flushed yet, the index never points at data missing from the log
+    vector<dead_letter_index_t> unindexed;
+    size_t                      lost; // records dropped with their segment, reported by the next flush() or close()
+
+    bool   openSegment(uint64_t time);
+    void closeSegment();
+    void writeIndex();
+    void resync();
+
+public:
+    dead_letter_store();
+
+    ~dead_letter_store()
+    {
+        close();
+    }
+
+    // Creates the directory if needed, a new segment is started on every open
+    bool open(const string &directory, size_t segmentSize);
+
+    // Number of records written but lost because the log or their index entries could not be flushed
+    size_t close();
+
+    void swap(dead_letter_store &other);
+
+    bool isOpen() const
+    {
+        return log != NULL;
+    }
+
+    bool isDirty() const
+    {
+        return !unindexed.empty();
+    }
+
+    const string &getDirectory() const
+    {
+        return directory;
+    }
+
+    size_t getSegmentSize() const
+    {
+        return segmentSize;
+    }
+
+    // False when the record is lost: the store is closed, a new segment could not be started or the write failed
+    bool append(const string &worker, const zmq::message_t &payload, dead_reason_t reason);
+
+    // Number of records lost, see close()
+    size_t flush();
+};
+
+#endif //SERVICE_QUEUE_DEAD_LETTERS_H
@@ -0,0 +1,142 @@
+#include "dedup_filter.hpp"
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+// second hash for double hashing, splitmix64 finalizer
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+
+    return x;
+}
+
+dedup_filter::dedup_filter()
+    : current(0), capacity(0), falsePositives(0), bits(0), hashes(0), window(0)
+{
+    inserted[0] = inserted[1] = 0;
+}
+
+void dedup_filter::configure(size_t capacity, double falsePositiveRate, long windowSec)
+{
+    window = chrono::seconds(windowSec < 1 ? 1 : windowSec);
+
+    if (capacity == dedup_filter::capacity && falsePositiveRate == falsePositives)
+    {
+        return;
+    }
+
+    dedup_filter::capacity = capacity;
+    falsePositives = falsePositiveRate;
+
+    inserted[0] = inserted[1] = 0;
+    current = 0;
+    rotated = chrono::steady_clock::now();
+
+    if (capacity == 0)
+    {
+        vector<uint64_t>().swap(generations[0]);
+        vector<uint64_t>().swap(generations[1]);
+
+        bits = 0;
+
+        return;
+    }
+
+    // a lookup checks both generations, so each gets half of the false positive budget
+    double rate  = min(max(falsePositiveRate / 2, 1e-12), 0.5);
+    size_t words = (size_t) ceil(-(double) capacity * log(rate) / (M_LN2 * M_LN2) / 64);
+
+    bits = words * 64;
+    hashes = (unsigned int) max(1.0, round((double) bits / capacity * M_LN2));
+
+    generations[0].assign(words, 0);
+    generations[1].assign(words, 0);
+}
+
+bool dedup_filter::contains(uint64_t key, steady_time_t now)
+{
+    if (now - rotated >= window)
+    {
+        rotate(now);
+    }
+
+    return test(generations[current], key) || test(generations[current ^ 1], key);
+}
+
+void dedup_filter::insert(uint64_t key, steady_time_t now)
+{
+    if (now - rotated >= window || inserted[current] >= capacity)
+    {
+        rotate(now);
+    }
+
+    vector<uint64_t> &filter = generations[current];
+    uint64_t          step   = mix(key) | 1;
+
+    for (unsigned int i = 0; i < hashes; i++)
+    {
+        uint64_t bit = (key + i * step) % bits;
+
+        filter[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+
+    inserted[current]++;
+}
+
+double dedup_filter::falsePositiveRate() const
+{
+    if (capacity == 0)
+    {
+        return 0;
+    }
+
+    double pass = 1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        pass *= 1 - pow(1 - exp(-(double) hashes * inserted[i] / bits), hashes);
+    }
+
+    return 1 - pass;
+}
+
+void dedup_filter::rotate(steady_time_t now)
+{
+    // idle for two windows, the older generation is stale as well
+    if (now - rotated >= window * 2)
+    {
+        fill(generations[current].begin(), generations[current].end(), 0);
+
+        inserted[current] = 0;
+    }
+
+    current ^= 1;
+
+    fill(generations[current].begin(), generations[current].end(), 0);
+
+    inserted[current] = 0;
+    rotated = now;
+}
+
+bool dedup_filter::test(const vector<uint64_t> &filter, uint64_t key) const
+{
+    uint64_t step = mix(key) | 1;
+
+    for (unsigned int i = 0; i < hashes; i++)
+    {
+        uint64_t bit = (key + i * step) % bits;
+
+        if ((filter[bit / 64] & ((uint64_t) 1 << (bit % 64))) == 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef SERVICE_QUEUE_DEDUP_FILTER_H
+#define SERVICE_QUEUE_DEDUP_FILTER_H
+
+#include "rate_limiter.hpp"
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// Idempotency keys seen recently, in two Bloom filter generations: keys go to the current one, lookups check both,
+// and the older one is cleared and becomes current after window or once capacity keys were added. A key is
+// remembered for at least window while fewer than capacity keys arrive in it. Memory is fixed by capacity and the
+// false positive rate; a false positive drops a message that was not a duplicate.
+class dedup_filter
+{
+
+private:
+    vector<uint64_t> generations[2];
+    size_t           inserted[2];
+    int              current;
+
+    size_t          capacity; // keys per generation, 0 - off
+    double          falsePositives;
+    size_t          bits;     // per generation
+    unsigned int    hashes;
+    chrono::seconds window;
+    steady_time_t   rotated;
+
+    void rotate(steady_time_t now);
+    bool test(const vector<uint64_t> &filter, uint64_t key) const;
+
+public:
+    dedup_filter();
+
+    // Keys are kept when nothing changed, so a reload does not forget them
+    void configure(size_t capacity, double falsePositiveRate, long windowSec);
+
+    bool enabled() const
+    {
+        return capacity > 0;
+    }
+
+    bool contains(uint64_t key, steady_time_t now);
+
+    void insert(uint64_t key, steady_time_t now);
+
+    size_t memoryBytes() const
+    {
+        return (generations[0].size() + generations[1].size()) * sizeof(uint64_t);
+    }
+
+    // chance that a key never seen is taken for a duplicate now, from how full both generations are
+    double falsePositiveRate() const;
+};
+
+#endif //SERVICE_QUEUE_DEDUP_FILTER_H
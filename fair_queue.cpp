@@ -0,0 +1,83 @@
+#include "fair_queue.hpp"
+
+using namespace std;
+
+fair_queue::fair_queue()
+    : quantum(65536), tenantLimit(1000), totalLimit(100000), queued(0)
+{
+}
+
+void fair_queue::configure(size_t quantum, size_t tenantLimit, size_t totalLimit)
+{
+    fair_queue::quantum = quantum < 1 ? 1 : quantum;
+    fair_queue::tenantLimit = tenantLimit < 1 ? 1 : tenantLimit;
+    fair_queue::totalLimit = totalLimit < 1 ? 1 : totalLimit;
+}
+
+bool fair_queue::push(const string &tenant, zmq::message_t &payload, uint32_t trace)
+{
+    fair_tenant_t &state = tenants[tenant];
+
+    if (state.messages.size() >= tenantLimit)
+    {
+        return false;
+    }
+
+    if (state.messages.empty())
+    {
+        state.name = tenant;
+        state.deficit = 0;
+
+        active.push_back(&state);
+    }
+
+    fair_message_t message = {move(payload), trace};
+
+    state.messages.push_back(move(message));
+
+    queued++;
+
+    return true;
+}
+
+bool fair_queue::pop(string &tenant, zmq::message_t &payload, uint32_t &trace)
+{
+    // amortized O(1) while quantum is not smaller than the largest message: each rotation to the back
+    // grants credit for at least one message of that tenant
+    while (!active.empty())
+    {
+        fair_tenant_t  *state   = active.front();
+        fair_message_t &message = state->messages.front();
+
+        if (message.payload.size() > state->deficit)
+        {
+            state->deficit += quantum;
+
+            active.pop_front();
+            active.push_back(state);
+
+            continue;
+        }
+
+        state->deficit -= message.payload.size();
+
+        tenant = state->name;
+        payload.move(&message.payload);
+        trace = message.trace;
+
+        state->messages.pop_front();
+
+        queued--;
+
+        // an idle tenant keeps no credit from earlier rounds
+        if (state->messages.empty())
+        {
+            active.pop_front();
+            tenants.erase(tenant);
+        }
+
+        return true;
+    }
+
+    return false;
+}
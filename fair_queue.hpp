@@ -0,0 +1,74 @@
+#ifndef SERVICE_QUEUE_FAIR_QUEUE_H
+#define SERVICE_QUEUE_FAIR_QUEUE_H
+
+#include "zmq.hpp"
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+using namespace std;
+
+typedef struct
+{
+    zmq::message_t payload;
+    uint32_t       trace;
+} fair_message_t;
+
+typedef struct
+{
+    string                 name;
+    deque<fair_message_t>  messages;
+    size_t                 deficit; // bytes the tenant may still take in this round
+} fair_tenant_t;
+
+// Deficit round robin over per-tenant queues: each round a tenant with queued messages gets quantum bytes
+// of credit and sends while its next message fits, so tenants get an equal share of bytes no matter how many
+// connections or how large messages they have. Only tenants with queued messages are kept.
+class fair_queue
+{
+
+private:
+    // element references stay valid while others are added or erased
+    unordered_map<string, fair_tenant_t> tenants;
+    deque<fair_tenant_t *>               active;
+
+    size_t quantum;
+    size_t tenantLimit;
+    size_t totalLimit;
+    size_t queued;
+
+public:
+    fair_queue();
+
+    void configure(size_t quantum, size_t tenantLimit, size_t totalLimit);
+
+    // Takes the payload over, false when the tenant's queue is full
+    bool push(const string &tenant, zmq::message_t &payload, uint32_t trace);
+
+    // Next message in DRR order, false when nothing is queued
+    bool pop(string &tenant, zmq::message_t &payload, uint32_t &trace);
+
+    bool empty() const
+    {
+        return queued == 0;
+    }
+
+    // no more input should be read until something is popped
+    bool full() const
+    {
+        return queued >= totalLimit;
+    }
+
+    size_t size() const
+    {
+        return queued;
+    }
+
+    size_t activeTenants() const
+    {
+        return active.size();
+    }
+};
+
+#endif //SERVICE_QUEUE_FAIR_QUEUE_H
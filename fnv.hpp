@@ -0,0 +1,20 @@
+#ifndef SERVICE_QUEUE_FNV_H
+#define SERVICE_QUEUE_FNV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// FNV-1a, for keys of in-memory tables and the dead letter index
+inline uint64_t fnv1a64(const char *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+#endif //SERVICE_QUEUE_FNV_H
@@ -0,0 +1,261 @@
+#include "json_scanner.hpp"
+#include <iomanip>
+#include <limits.h>
+#include <stdint.h>
+
+using namespace std;
+
+static const char *skipSpace(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    {
+        p++;
+    }
+
+    return p;
+}
+
+// p points to the opening quote, returns the position after the closing one
+static const char *skipString(const char *p, const char *end)
+{
+    for (p++; p < end; p++)
+    {
+        if (*p == '\\')
+        {
+            p++;
+        }
+        else if (*p == '"')
+        {
+            return p + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static const char *skipValue(const char *p, const char *end)
+{
+    if (p >= end)
+    {
+        return NULL;
+    }
+
+    if (*p == '"')
+    {
+        return skipString(p, end);
+    }
+
+    if (*p == '{' || *p == '[')
+    {
+        int depth = 0;
+
+        while (p < end)
+        {
+            if (*p == '"')
+            {
+                p = skipString(p, end);
+
+                if (p == NULL)
+                {
+                    return NULL;
+                }
+
+                continue;
+            }
+
+            if (*p == '{' || *p == '[')
+            {
+                depth++;
+            }
+            else if (*p == '}' || *p == ']')
+            {
+                if (--depth == 0)
+                {
+                    return p + 1;
+                }
+            }
+
+            p++;
+        }
+
+        return NULL;
+    }
+
+    // number, true, false, null
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+    {
+        p++;
+    }
+
+    return p;
+}
+
+bool findJsonValue(const slice_t &json, const char *key, slice_t &value)
+{
+    const char *p      = json.data;
+    const char *end    = json.data + json.size;
+    size_t      keyLen = strlen(key);
+
+    p = skipSpace(p, end);
+
+    if (p >= end || *p != '{')
+    {
+        return false;
+    }
+
+    p++;
+
+    while (true)
+    {
+        p = skipSpace(p, end);
+
+        if (p >= end || *p != '"')
+        {
+            return false;
+        }
+
+        const char *keyStart = p + 1;
+
+        p = skipString(p, end);
+
+        if (p == NULL)
+        {
+            return false;
+        }
+
+        const char *keyEnd = p - 1;
+
+        p = skipSpace(p, end);
+
+        if (p >= end || *p != ':')
+        {
+            return false;
+        }
+
+        p = skipSpace(p + 1, end);
+
+        const char *valueStart = p;
+
+        p = skipValue(p, end);
+
+        if (p == NULL)
+        {
+            return false;
+        }
+
+        if ((size_t) (keyEnd - keyStart) == keyLen && 0 == memcmp(keyStart, key, keyLen))
+        {
+            if (*valueStart == '"')
+            {
+                value.data = valueStart + 1;
+                value.size = p - valueStart - 2;
+            }
+            else
+            {
+                value.data = valueStart;
+                value.size = p - valueStart;
+            }
+
+            return true;
+        }
+
+        p = skipSpace(p, end);
+
+        if (p >= end || *p != ',')
+        {
+            return false;
+        }
+
+        p++;
+    }
+}
+
+bool jsonBool(const slice_t &json, const char *key, bool defaultValue)
+{
+    slice_t value;
+
+    if (!findJsonValue(json, key, value) || value.size == 0)
+    {
+        return defaultValue;
+    }
+
+    if (value == "true")
+    {
+        return true;
+    }
+
+    if (value == "false" || value == "null")
+    {
+        return false;
+    }
+
+    if (value.data[0] >= '0' && value.data[0] <= '9')
+    {
+        return jsonUInt(json, key, 0) != 0;
+    }
+
+    return defaultValue;
+}
+
+unsigned int jsonUInt(const slice_t &json, const char *key, unsigned int defaultValue)
+{
+    uint64_t result = jsonUInt64(json, key, defaultValue);
+
+    return result > UINT_MAX ? defaultValue : (unsigned int) result;
+}
+
+uint64_t jsonUInt64(const slice_t &json, const char *key, uint64_t defaultValue)
+{
+    slice_t  value;
+    uint64_t result = 0;
+
+    if (!findJsonValue(json, key, value) || value.size == 0)
+    {
+        return defaultValue;
+    }
+
+    for (size_t i = 0; i < value.size; i++)
+    {
+        // a fraction, an exponent or a sign is not an unsigned integer
+        if (value.data[i] < '0' || value.data[i] > '9')
+        {
+            return defaultValue;
+        }
+
+        unsigned int digit = value.data[i] - '0';
+
+        if (result > (UINT64_MAX - digit) / 10)
+        {
+            return defaultValue;
+        }
+
+        result = result * 10 + digit;
+    }
+
+    return result;
+}
+
+void writeJsonString(ostream &out, const string &value)
+{
+    out << '"';
+
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        unsigned char c = value[i];
+
+        if (c == '"' || c == '\\')
+        {
+            out << '\\' << c;
+        }
+        else if (c < 0x20)
+        {
+            out << "\\u" << hex << setw(4) << setfill('0') << (int) c << dec << setfill(' ');
+        }
+        else
+        {
+            out << c;
+        }
+    }
+
+    out << '"';
+}
@@ -0,0 +1,20 @@
+#ifndef SERVICE_QUEUE_JSON_SCANNER_H
+#define SERVICE_QUEUE_JSON_SCANNER_H
+
+#include "slice.hpp"
+#include <ostream>
+
+using namespace std;
+
+// Finds the value of a top-level key of a JSON object in place, without building a DOM or allocating.
+// String values are returned without quotes and with escapes left as is, other values as raw tokens.
+bool findJsonValue(const slice_t &json, const char *key, slice_t &value);
+
+bool jsonBool(const slice_t &json, const char *key, bool defaultValue);
+unsigned int jsonUInt(const slice_t &json, const char *key, unsigned int defaultValue);
+uint64_t jsonUInt64(const slice_t &json, const char *key, uint64_t defaultValue);
+
+// Writes value as a quoted JSON string, escaping quotes, backslashes and control characters
+void writeJsonString(ostream &out, const string &value);
+
+#endif //SERVICE_QUEUE_JSON_SCANNER_H
@@ -3,6 +3,9 @@
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
+#include <boost/asio/ip/host_name.hpp>
+#include <boost/foreach.hpp>
+#include <algorithm>
 
 #include <boost/log/utility/setup.hpp>
 #include <boost/log/utility/setup/file.hpp>
@@ -47,39 +50,309 @@ void initFileLogging(string config)
     );
 }
 
-int main(int argc, char* argv[])
+// Everything config.json sets, read and checked before any of it is applied
+typedef struct
 {
-    initLogging();
+    string         input;
+    vector<string> outputs;
+    string         service;
+    string         ackInput;
+    string         fairInput;
+    string         broadcastInput;
 
-    BOOST_LOG_SCOPED_THREAD_TAG("ThreadID", boost::this_thread::get_id());
+    size_t fairQuantum;
+    size_t fairTenantLimit;
+    size_t fairTotalLimit;
 
-    string config = "default";
-    boost::property_tree::ptree pt;
+    size_t dedupCapacity;
+    double dedupFpRate;
+    long   dedupWindow;
 
-    if (argc > 1)
+    unsigned int ackBatch;
+    long         ackInterval;
+
+    double            globalRate;
+    double            globalBurst;
+    double            producerRate;
+    double            producerBurst;
+    overflow_policy_t overflow;
+
+    scheduler_t scheduler;
+
+    long heartbeatInterval;
+    long heartbeatTimeout;
+    long drainTimeout;
+
+    string supervisorCommand;
+    size_t supervisorMin;
+    size_t supervisorMax;
+    size_t scaleUpQueue;
+    long   scaleUpWait;
+    long   scaleDownIdle;
+    long   stopTimeout;
+
+    size_t streamWindow;
+    long   streamIdleTimeout;
+
+    size_t batchMessages;
+    long   batchDelay;
+
+    size_t compressionThreads;
+    size_t compressionThreshold;
+    int    compressionLevel;
+    double compressionMaxRatio;
+
+    string deadLetters;
+    size_t segmentSize;
+    string snapshot;
+
+    unsigned int traceEvery;
+    size_t       traceEvents;
+
+    string                        federationName;
+    unsigned int                  federationCredit;
+    vector<pair<string, string> > peers; // output, service
+} settings_t;
+
+bool readSettings(boost::property_tree::ptree &pt, const string &config, settings_t &settings)
+{
+    string overflow  = pt.get<string>("limits.overflow", "shed");
+    string scheduler = pt.get<string>("routing.scheduler", "round_robin");
+
+    if (overflow == "shed")
     {
-        config = argv[1];
+        settings.overflow = OVERFLOW_SHED;
+    }
+    else if (overflow == "block")
+    {
+        settings.overflow = OVERFLOW_BLOCK;
     }
+    else
+    {
+        ERR << "Config error: unknown limits.overflow: " << overflow;
+
+        return false;
+    }
+
+    if (scheduler == "round_robin")
+    {
+        settings.scheduler = SCHEDULER_ROUND_ROBIN;
+    }
+    else if (scheduler == "p2c")
+    {
+        settings.scheduler = SCHEDULER_P2C;
+    }
+    else
+    {
+        ERR << "Config error: unknown routing.scheduler: " << scheduler;
+
+        return false;
+    }
+
+    // "output" is one endpoint or a list of them
+    boost::property_tree::ptree &output = pt.get_child("ports.output");
+
+    if (output.empty())
+    {
+        settings.outputs.push_back(output.data());
+    }
+
+    BOOST_FOREACH(boost::property_tree::ptree::value_type &endpoint, output)
+    {
+        settings.outputs.push_back(endpoint.second.data());
+    }
+
+    // an empty or repeated endpoint would only fail later, at bind
+    for (size_t i = 0; i < settings.outputs.size(); i++)
+    {
+        if (settings.outputs[i].empty())
+        {
+            ERR << "Config error: empty ports.output";
+
+            return false;
+        }
+
+        if (find(settings.outputs.begin(), settings.outputs.begin() + i, settings.outputs[i]) != settings.outputs.begin() + i)
+        {
+            ERR << "Config error: ports.output lists " << settings.outputs[i] << " twice";
+
+            return false;
+        }
+    }
+
+    settings.input = pt.get<string>("ports.input");
+    settings.service = pt.get<string>("ports.service");
+    settings.ackInput = pt.get<string>("ports.ack_input", "");
+    settings.fairInput = pt.get<string>("ports.fair_input", "");
+    settings.broadcastInput = pt.get<string>("ports.broadcast_input", "");
+
+    settings.fairQuantum = pt.get<size_t>("fair.quantum", 65536);
+    settings.fairTenantLimit = pt.get<size_t>("fair.tenant_limit", 1000);
+    settings.fairTotalLimit = pt.get<size_t>("fair.total_limit", 100000);
+
+    settings.dedupCapacity = pt.get<size_t>("dedup.capacity", 0);
+    settings.dedupFpRate = pt.get<double>("dedup.fp_rate", 0.001);
+    settings.dedupWindow = pt.get<long>("dedup.window_s", 300);
+
+    settings.ackBatch = pt.get<unsigned int>("acks.batch", 64);
+    settings.ackInterval = pt.get<long>("acks.interval_ms", 5);
+
+    settings.globalRate = pt.get<double>("limits.global.rate", 0);
+    settings.globalBurst = pt.get<double>("limits.global.burst", 0);
+    settings.producerRate = pt.get<double>("limits.producer.rate", 0);
+    settings.producerBurst = pt.get<double>("limits.producer.burst", 0);
+
+    settings.heartbeatInterval = pt.get<long>("heartbeat.interval", WORKER_HB_INTERVAL);
+    settings.heartbeatTimeout = pt.get<long>("heartbeat.timeout", WORKER_HB_TIMEOUT);
+    settings.drainTimeout = pt.get<long>("shutdown.drain_timeout", SHUTDOWN_DRAIN_TIMEOUT);
+
+    settings.supervisorCommand = pt.get<string>("supervisor.command", "");
+    settings.supervisorMin = pt.get<size_t>("supervisor.min", 1);
+    settings.supervisorMax = pt.get<size_t>("supervisor.max", 4);
+    settings.scaleUpQueue = pt.get<size_t>("supervisor.scale_up_queue", 1000);
+    settings.scaleUpWait = pt.get<long>("supervisor.scale_up_wait_ms", 100);
+    settings.scaleDownIdle = pt.get<long>("supervisor.scale_down_idle_s", 60);
+    settings.stopTimeout = pt.get<long>("supervisor.stop_timeout_s", 30);
+
+    settings.streamWindow = pt.get<size_t>("streaming.window", 16);
+    settings.streamIdleTimeout = pt.get<long>("streaming.idle_timeout_s", 60);
+
+    settings.batchMessages = pt.get<size_t>("batching.max_messages", 0);
+    settings.batchDelay = pt.get<long>("batching.max_delay_us", 1000);
+
+    settings.compressionThreads = pt.get<size_t>("compression.threads", 2);
+    settings.compressionThreshold = pt.get<size_t>("compression.threshold", 4096);
+    settings.compressionLevel = pt.get<int>("compression.level", 1);
+    settings.compressionMaxRatio = pt.get<double>("compression.max_ratio", 0.9);
+
+    settings.deadLetters = pt.get<bool>("dead_letters.enabled", false) ? "./" + config + "/dead_letters" : "";
+    settings.segmentSize = pt.get<size_t>("dead_letters.segment_mb", 64) << 20;
+    settings.snapshot = pt.get<bool>("registry.snapshot", false) ? "./" + config + "/workers.snapshot" : "";
+
+    settings.traceEvery = pt.get<unsigned int>("tracing.sample_every", 0);
+    settings.traceEvents = pt.get<size_t>("tracing.events", 65536);
+
+    settings.federationName = pt.get<string>("federation.name", boost::asio::ip::host_name());
+    settings.federationCredit = pt.get<unsigned int>("federation.credit", 100);
+
+    if (pt.get_child_optional("federation.peers"))
+    {
+        BOOST_FOREACH(boost::property_tree::ptree::value_type &peer, pt.get_child("federation.peers"))
+        {
+            settings.peers.push_back(make_pair(peer.second.get<string>("output"), peer.second.get<string>("service")));
+        }
+    }
+
+    return true;
+}
+
+// Reads ./<config>/config.json into the broker; on reload only what can change live is applied.
+// A config that fails to parse, validate or open its dead letters changes nothing.
+bool configure(broker *br, const string &config, bool reload)
+{
+    boost::property_tree::ptree pt;
+    settings_t                  settings;
 
     try
     {
         std::ifstream ifs("./" + config + "/config.json");
         boost::property_tree::read_json(ifs, pt);
 
-        initFileLogging(config);
+        if (!readSettings(pt, config, settings))
+        {
+            return false;
+        }
     }
     catch (boost::property_tree::ptree_error e)
     {
         ERR << "Config error: " << e.what();
 
-        return 1;
+        return false;
+    }
+
+    if (!reload)
+    {
+        initFileLogging(config);
+    }
+
+    // the only step that can fail, it keeps the running store unless the new one opened
+    if (!br->setDeadLetters(settings.deadLetters, settings.segmentSize))
+    {
+        return false;
+    }
+
+    br->setInputDSN(settings.input);
+    br->setOutputDSNs(settings.outputs);
+    br->setServiceDSN(settings.service);
+    br->setAckInputDSN(settings.ackInput);
+    br->setFairInputDSN(settings.fairInput);
+    br->setBroadcastInputDSN(settings.broadcastInput);
+
+    br->setFairQueuing(settings.fairQuantum, settings.fairTenantLimit, settings.fairTotalLimit);
+
+    br->setDedup(settings.dedupCapacity, settings.dedupFpRate, settings.dedupWindow);
+
+    br->setAcks(settings.ackBatch, settings.ackInterval);
+
+    br->setGlobalRateLimit(settings.globalRate, settings.globalBurst);
+    br->setProducerRateLimit(settings.producerRate, settings.producerBurst);
+    br->setOverflowPolicy(settings.overflow);
+
+    br->setScheduler(settings.scheduler);
+
+    br->setHeartbeat(settings.heartbeatInterval, settings.heartbeatTimeout);
+
+    br->setDrainTimeout(settings.drainTimeout);
+
+    br->setSupervisor(settings.supervisorCommand, settings.supervisorMin, settings.supervisorMax, settings.scaleUpQueue,
+                      settings.scaleUpWait, settings.scaleDownIdle, settings.stopTimeout);
+
+    br->setStreaming(settings.streamWindow, settings.streamIdleTimeout);
+
+    br->setBatching(settings.batchMessages, settings.batchDelay);
+
+    br->setCompression(settings.compressionThreads, settings.compressionThreshold, settings.compressionLevel,
+                       settings.compressionMaxRatio);
+
+    br->setWorkerSnapshot(settings.snapshot);
+
+    br->setTracing(settings.traceEvery, settings.traceEvents, "./" + config);
+
+    // peer links are set up once, changing them needs a restart
+    if (!reload)
+    {
+        br->setFederation(settings.federationName, settings.federationCredit);
+
+        for (vector<pair<string, string> >::iterator it = settings.peers.begin(); it < settings.peers.end(); it++)
+        {
+            br->addPeer((*it).first, (*it).second);
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    initLogging();
+
+    BOOST_LOG_SCOPED_THREAD_TAG("ThreadID", boost::this_thread::get_id());
+
+    string config = "default";
+
+    if (argc > 1)
+    {
+        config = argv[1];
     }
 
     broker *br = broker::getInstance();
 
-    br->setInputDSN(pt.get<string>("ports.input"));
-    br->setOutputDSN(pt.get<string>("ports.output"));
-    br->setServiceDSN(pt.get<string>("ports.service"));
+    if (!configure(br, config, false))
+    {
+        return 1;
+    }
+
+    br->setReloadHandler([br, config]() { return configure(br, config, true); });
 
     br->run();
 
@@ -12,4 +12,29 @@
 #define WORKER_HB_TIMEOUT  10
 #define WORKER_HB_INTERVAL 30
 
+#define WORKER_PROBE_INTERVAL_MS 250
+#define WORKER_CONNECT_MS        1000 // a new worker unreachable on output this soon is probed, not dropped
+#define WORKER_SNAPSHOT_INTERVAL 5
+
+#define METRICS_LOG_INTERVAL 60
+
+#define SHUTDOWN_DRAIN_TIMEOUT 30
+#define DRAIN_PONG_TIMEOUT_MS  1000 // a worker that does not answer a ping while draining is given up
+
+#define POLL_BURST 256
+
+#define LATENCY_EWMA_WEIGHT 0.3
+#define LOAD_EWMA_WEIGHT    0.1
+
+#define PEER_REGISTER_BACKOFF 5
+
+#define DEAD_LETTER_FLUSH_INTERVAL 1
+
+#define COMPRESSION_QUEUE_MAX 4096 // payloads handed to the compressor and not sent yet, over it they go uncompressed
+
+#define SUPERVISOR_INTERVAL_MS  1000
+#define SUPERVISOR_BOOT_TIMEOUT 10 // a started worker that has not registered by then counts as running
+#define SUPERVISOR_BACKOFF_MAX  60
+#define SUPERVISOR_REAP_MS      50 // while local workers exit on shutdown
+
 #endif //SERVICE_QUEUE_MAIN_HPP
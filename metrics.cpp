@@ -0,0 +1,64 @@
+#include "metrics.hpp"
+#include <sstream>
+
+using namespace std;
+
+counter_t & metrics::counter(const string &name)
+{
+    registryLock.lock();
+
+    for (deque<metric_t>::iterator it = registry.begin(); it < registry.end(); it++)
+    {
+        if (name == (*it).name)
+        {
+            registryLock.unlock();
+
+            return (*it).value;
+        }
+    }
+
+    registry.emplace_back();
+
+    metric_t &metric = registry.back();
+
+    metric.name = name;
+    metric.value = 0;
+
+    registryLock.unlock();
+
+    return metric.value;
+}
+
+vector<pair<string, uint64_t> > metrics::snapshot()
+{
+    vector<pair<string, uint64_t> > result;
+
+    registryLock.lock();
+
+    for (deque<metric_t>::iterator it = registry.begin(); it < registry.end(); it++)
+    {
+        result.push_back(make_pair((*it).name, (*it).value.load(memory_order_relaxed)));
+    }
+
+    registryLock.unlock();
+
+    return result;
+}
+
+string metrics::format()
+{
+    vector<pair<string, uint64_t> > values = snapshot();
+    stringstream                    ss;
+
+    for (vector<pair<string, uint64_t> >::iterator it = values.begin(); it < values.end(); it++)
+    {
+        if (it != values.begin())
+        {
+            ss << " ";
+        }
+
+        ss << (*it).first << "=" << (*it).second;
+    }
+
+    return ss.str();
+}
@@ -0,0 +1,39 @@
+#ifndef SERVICE_QUEUE_METRICS_H
+#define SERVICE_QUEUE_METRICS_H
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+typedef atomic<uint64_t> counter_t;
+
+typedef struct
+{
+    string    name;
+    counter_t value;
+} metric_t;
+
+class metrics
+{
+
+private:
+    // deque keeps references returned by counter() valid while new metrics are added
+    deque<metric_t> registry;
+    mutex           registryLock;
+
+public:
+    // Returns the counter registered under name, creating it on first use.
+    // Look counters up once and keep the reference: the lookup itself is not meant for hot paths.
+    counter_t & counter(const string &name);
+
+    vector<pair<string, uint64_t> > snapshot();
+
+    string format();
+};
+
+#endif //SERVICE_QUEUE_METRICS_H
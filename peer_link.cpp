@@ -0,0 +1,126 @@
+#include "peer_link.hpp"
+#include "main.hpp"
+#include <sstream>
+
+using namespace std;
+
+peer_link::peer_link(const string &outputDSN, const string &serviceDSN)
+    : output(NULL), service(NULL), outputDSN(outputDSN), serviceDSN(serviceDSN), credit(0),
+      registered(false), lastSeen(0), lastRegistered(0)
+{
+}
+
+void peer_link::connect(zmq::context_t &ctx, const string &identity, unsigned int credit)
+{
+    int linger = 0;
+
+    peer_link::identity = identity;
+    peer_link::credit = credit;
+
+    output = new zmq::socket_t(ctx, ZMQ_DEALER);
+    output->setsockopt(ZMQ_IDENTITY, identity.data(), identity.size());
+    output->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    output->connect(outputDSN.c_str());
+
+    service = new zmq::socket_t(ctx, ZMQ_DEALER);
+    service->setsockopt(ZMQ_IDENTITY, identity.data(), identity.size());
+    service->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    service->connect(serviceDSN.c_str());
+
+    LOG << "Federation: connected to " << outputDSN << " as " << identity;
+}
+
+void peer_link::close()
+{
+    if (output == NULL)
+    {
+        return;
+    }
+
+    output->close();
+    service->close();
+
+    delete output;
+    delete service;
+
+    output = NULL;
+    service = NULL;
+}
+
+void peer_link::sendService(const string &data)
+{
+    zmq::message_t delimiter(0);
+    zmq::message_t message(data.size());
+
+    memcpy(message.data(), data.data(), data.size());
+
+    try
+    {
+        service->send(delimiter, ZMQ_SNDMORE);
+        service->send(message);
+    }
+    catch (zmq::error_t e)
+    {
+        ERR << "Federation: send to " << serviceDSN << " failed: error " << e.num() << ": " << e.what();
+    }
+}
+
+void peer_link::pong()
+{
+    time(&lastSeen);
+
+    sendService("{\"action\":\"pong\"}");
+}
+
+void peer_link::done()
+{
+    sendService("{\"action\":\"done\"}");
+}
+
+void peer_link::lost()
+{
+    if (registered)
+    {
+        ERR << "Federation: dropped by " << outputDSN;
+    }
+
+    registered = false;
+}
+
+void peer_link::keepAlive(time_t now, long silence)
+{
+    if (registered && difftime(now, lastSeen) <= silence)
+    {
+        return;
+    }
+
+    if (difftime(now, lastRegistered) < PEER_REGISTER_BACKOFF)
+    {
+        return;
+    }
+
+    stringstream ss;
+
+    ss << "{\"action\":\"service.register\",\"peer\":true,\"credit\":" << credit << "}";
+
+    sendService(ss.str());
+
+    if (registered)
+    {
+        ERR << "Federation: no ping from " << outputDSN << ", registering again";
+    }
+
+    registered = true;
+    lastSeen = now;
+    lastRegistered = now;
+}
+
+void peer_link::unregister()
+{
+    if (registered)
+    {
+        sendService("{\"action\":\"service.shutdown\"}");
+    }
+
+    registered = false;
+}
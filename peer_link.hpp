@@ -0,0 +1,60 @@
+#ifndef SERVICE_QUEUE_PEER_LINK_H
+#define SERVICE_QUEUE_PEER_LINK_H
+
+#include "zmq.hpp"
+#include <string>
+#include <time.h>
+
+using namespace std;
+
+// Connection to a peer broker, registered there as a pseudo-worker.
+// The peer sends us its overflow over output and we report every message handed to a local worker with "done",
+// so the credit announced at registration bounds the number of messages queued on the link.
+class peer_link
+{
+
+private:
+    zmq::socket_t *output;
+    zmq::socket_t *service;
+
+    string outputDSN;
+    string serviceDSN;
+    string identity;
+
+    unsigned int credit;
+
+    bool   registered;
+    time_t lastSeen;
+    time_t lastRegistered;
+
+    void sendService(const string &data);
+
+public:
+    peer_link(const string &outputDSN, const string &serviceDSN);
+
+    void connect(zmq::context_t &ctx, const string &identity, unsigned int credit);
+    void close();
+
+    zmq::socket_t *getOutput()
+    {
+        return output;
+    }
+
+    const string &getOutputDSN() const
+    {
+        return outputDSN;
+    }
+
+    void pong();
+    void done();
+
+    // Peer removed us (shutdown received), register again later
+    void lost();
+
+    // Registers again when the peer sent no ping for silence seconds, e.g. it was restarted and forgot about us
+    void keepAlive(time_t now, long silence);
+
+    void unregister();
+};
+
+#endif //SERVICE_QUEUE_PEER_LINK_H
@@ -0,0 +1,114 @@
+#ifndef SERVICE_QUEUE_PROTOCOL_H
+#define SERVICE_QUEUE_PROTOCOL_H
+
+#include "zmq.hpp"
+#include "slice.hpp"
+#include "client/protocol.hpp"
+#include <string>
+#include <cstring>
+#include <stdint.h>
+
+using namespace std;
+
+// shared with the client library, which keeps them in its namespace
+using service_queue::controlMessage;
+using service_queue::isControlMessage;
+using service_queue::encodeSeq;
+using service_queue::decodeSeq;
+
+// Actions workers and tools send to the service socket
+typedef enum
+{
+    ACTION_UNKNOWN,
+    ACTION_REGISTER,
+    ACTION_SHUTDOWN,
+    ACTION_PONG,
+    ACTION_DONE,
+    ACTION_QUIT,
+    ACTION_ADMIN_STATUS,     // answered with the broker state, see service_queue_ctl
+    ACTION_ADMIN_DRAIN,      // {"worker": id}
+    ACTION_ADMIN_QUARANTINE, // {"worker": id}
+    ACTION_ADMIN_RELEASE     // {"worker": id}
+} service_action_t;
+
+inline service_action_t internAction(const slice_t &action)
+{
+    // length and one character pick the only candidate, one memcmp confirms it
+    const char       *candidate = NULL;
+    service_action_t  result    = ACTION_UNKNOWN;
+
+    switch (action.size)
+    {
+        case 4:
+            // pong, done, quit
+            switch (action.data[0])
+            {
+                case 'p':
+                    candidate = "pong";
+                    result    = ACTION_PONG;
+
+                    break;
+
+                case 'd':
+                    candidate = "done";
+                    result    = ACTION_DONE;
+
+                    break;
+
+                case 'q':
+                    candidate = "quit";
+                    result    = ACTION_QUIT;
+
+                    break;
+            }
+
+            break;
+
+        case 11:
+            candidate = "admin.drain";
+            result    = ACTION_ADMIN_DRAIN;
+
+            break;
+
+        case 12:
+            candidate = "admin.status";
+            result    = ACTION_ADMIN_STATUS;
+
+            break;
+
+        case 13:
+            candidate = "admin.release";
+            result    = ACTION_ADMIN_RELEASE;
+
+            break;
+
+        case 16:
+            // service.register, service.shutdown and admin.quarantine differ in the 9th character
+            switch (action.data[8])
+            {
+                case 'r':
+                    candidate = "service.register";
+                    result    = ACTION_REGISTER;
+
+                    break;
+
+                case 's':
+                    candidate = "service.shutdown";
+                    result    = ACTION_SHUTDOWN;
+
+                    break;
+
+                case 'a':
+                    candidate = "admin.quarantine";
+                    result    = ACTION_ADMIN_QUARANTINE;
+
+                    break;
+            }
+
+            break;
+    }
+
+    return candidate != NULL && 0 == memcmp(action.data, candidate, action.size) ? result : ACTION_UNKNOWN;
+}
+
+#endif //SERVICE_QUEUE_PROTOCOL_H
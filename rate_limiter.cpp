@@ -0,0 +1,191 @@
+#include "rate_limiter.hpp"
+#include "fnv.hpp"
+
+using namespace std;
+
+#define PRODUCER_SWEEP_INTERVAL 10
+
+token_bucket::token_bucket()
+    : rate(0), burst(0), tokens(0), updated(chrono::steady_clock::now())
+{
+}
+
+void token_bucket::configure(double rate, double burst)
+{
+    if (burst < 1)
+    {
+        // one second worth of tokens unless configured otherwise
+        burst = rate < 1 ? 1 : rate;
+    }
+
+    token_bucket::rate = rate;
+    token_bucket::burst = burst;
+
+    tokens = burst;
+    updated = chrono::steady_clock::now();
+}
+
+void token_bucket::refill(steady_time_t now)
+{
+    if (tokens >= burst || now <= updated)
+    {
+        updated = now;
+
+        return;
+    }
+
+    tokens += chrono::duration<double>(now - updated).count() * rate;
+
+    if (tokens > burst)
+    {
+        tokens = burst;
+    }
+
+    updated = now;
+}
+
+bool token_bucket::consume(steady_time_t now)
+{
+    if (!limited())
+    {
+        return true;
+    }
+
+    refill(now);
+
+    if (tokens < 1)
+    {
+        return false;
+    }
+
+    tokens -= 1;
+
+    return true;
+}
+
+void token_bucket::refund()
+{
+    if (limited())
+    {
+        tokens += 1;
+    }
+}
+
+chrono::microseconds token_bucket::wait(steady_time_t now)
+{
+    if (!limited())
+    {
+        return chrono::microseconds(0);
+    }
+
+    refill(now);
+
+    if (tokens >= 1)
+    {
+        return chrono::microseconds(0);
+    }
+
+    return chrono::microseconds((long long) ((1 - tokens) / rate * 1000000) + 1);
+}
+
+bool token_bucket::idle(steady_time_t now)
+{
+    refill(now);
+
+    return tokens >= burst;
+}
+
+rate_limiter::rate_limiter()
+    : producerRate(0), producerBurst(0), lastSweep(chrono::steady_clock::now()), policy(OVERFLOW_SHED)
+{
+}
+
+void rate_limiter::setGlobalLimit(double rate, double burst)
+{
+    global.configure(rate, burst);
+}
+
+void rate_limiter::setProducerLimit(double rate, double burst)
+{
+    producerRate = rate;
+    producerBurst = burst;
+
+    producers.clear();
+}
+
+bool rate_limiter::admit(const char *producer, size_t size, steady_time_t now)
+{
+    token_bucket *bucket = NULL;
+
+    if (producerRate > 0 && producer != NULL)
+    {
+        sweep(now);
+
+        uint64_t                                        key = fnv1a64(producer, size);
+        unordered_map<uint64_t, token_bucket>::iterator it  = producers.find(key);
+
+        if (it == producers.end())
+        {
+            it = producers.insert(make_pair(key, token_bucket())).first;
+            it->second.configure(producerRate, producerBurst);
+        }
+
+        bucket = &it->second;
+
+        if (!bucket->consume(now))
+        {
+            return false;
+        }
+    }
+
+    if (!global.consume(now))
+    {
+        if (bucket != NULL)
+        {
+            bucket->refund();
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+chrono::microseconds rate_limiter::wait(const char *producer, size_t size, steady_time_t now)
+{
+    chrono::microseconds result = global.wait(now);
+
+    if (producerRate > 0 && producer != NULL)
+    {
+        unordered_map<uint64_t, token_bucket>::iterator it = producers.find(fnv1a64(producer, size));
+
+        if (it != producers.end())
+        {
+            result = max(result, it->second.wait(now));
+        }
+    }
+
+    return result;
+}
+
+void rate_limiter::sweep(steady_time_t now)
+{
+    if (now - lastSweep < chrono::seconds(PRODUCER_SWEEP_INTERVAL))
+    {
+        return;
+    }
+
+    lastSweep = now;
+
+    for (unordered_map<uint64_t, token_bucket>::iterator it = producers.begin(); it != producers.end();)
+    {
+        if (it->second.idle(now))
+        {
+            it = producers.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef SERVICE_QUEUE_RATE_LIMITER_H
+#define SERVICE_QUEUE_RATE_LIMITER_H
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+using namespace std;
+
+typedef chrono::steady_clock::time_point steady_time_t;
+
+typedef enum
+{
+    OVERFLOW_SHED,  // drop the message and count it
+    OVERFLOW_BLOCK  // stop reading input until a token is available, HWM pushes back on producers
+} overflow_policy_t;
+
+class token_bucket
+{
+
+private:
+    double        rate;   // tokens per second, 0 - unlimited
+    double        burst;
+    double        tokens;
+    steady_time_t updated;
+
+    void refill(steady_time_t now);
+
+public:
+    token_bucket();
+
+    void configure(double rate, double burst);
+
+    bool limited() const
+    {
+        return rate > 0;
+    }
+
+    bool consume(steady_time_t now);
+    void refund();
+
+    // Time left until the next token becomes available
+    chrono::microseconds wait(steady_time_t now);
+
+    // Bucket is full again, so forgetting it changes nothing
+    bool idle(steady_time_t now);
+};
+
+class rate_limiter
+{
+
+private:
+    token_bucket global;
+
+    double producerRate;
+    double producerBurst;
+
+    // keyed by a hash of the identity, so admitting a message allocates nothing; two producers sharing a bucket
+    // would need a 64 bit collision
+    unordered_map<uint64_t, token_bucket> producers;
+    steady_time_t                         lastSweep;
+
+    overflow_policy_t policy;
+
+    void sweep(steady_time_t now);
+
+public:
+    rate_limiter();
+
+    void setGlobalLimit(double rate, double burst);
+    void setProducerLimit(double rate, double burst);
+
+    void setPolicy(overflow_policy_t policy)
+    {
+        rate_limiter::policy = policy;
+    }
+
+    overflow_policy_t getPolicy() const
+    {
+        return policy;
+    }
+
+    bool enabled() const
+    {
+        return global.limited() || producerRate > 0;
+    }
+
+    bool perProducer() const
+    {
+        return producerRate > 0;
+    }
+
+    // Takes a token from the producer bucket and the global bucket, producer may be NULL
+    bool admit(const char *producer, size_t size, steady_time_t now);
+
+    chrono::microseconds wait(const char *producer, size_t size, steady_time_t now);
+};
+
+#endif //SERVICE_QUEUE_RATE_LIMITER_H
@@ -0,0 +1,322 @@
+#ifndef SERVICE_QUEUE_SHM_RING_H
+#define SERVICE_QUEUE_SHM_RING_H
+
+#include <atomic>
+#include <string>
+#include <climits>
+#include <new>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_RING_MAGIC   0x53515248 // SQRH
+#define SHM_RING_VERSION 1
+#define SHM_RING_WRAP    0xFFFFFFFF
+
+// In the client library's namespace, the worker uses it too
+namespace service_queue
+{
+    // Header at the start of the segment, head and tail live on separate cache lines
+    typedef struct
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t capacity;
+        char     pad0[48];
+
+        std::atomic<uint64_t> head; // written by the broker
+        char                  pad1[56];
+
+        std::atomic<uint64_t> tail; // written by the worker
+        char                  pad2[56];
+
+        std::atomic<uint32_t> signal;   // futex word, bumped on every wakeup
+        std::atomic<uint32_t> sleeping; // consumer is about to wait or waits on signal
+    } shm_ring_header_t;
+
+    // Single producer single consumer ring of length-prefixed records in a shared memory segment.
+    // The worker creates the segment and consumes, the broker on the same host maps it and produces.
+    // Records are 8-byte aligned, a record that does not fit before the end of the buffer is preceded by a wrap marker.
+    class shm_ring
+    {
+
+    private:
+        std::string        name;
+        bool               owner;
+        size_t             length;
+        shm_ring_header_t *header;
+        char              *data;
+        uint64_t           pending;  // size of the record returned by peek()
+        uint64_t           capacity; // as validated when mapped, the peer may rewrite the header afterwards
+        uint64_t           head;     // producer's own copy, published to the header after each push()
+
+        shm_ring(const std::string &name, bool owner, size_t length, void *memory, uint64_t capacity, uint64_t head)
+            : name(name), owner(owner), length(length), header(static_cast<shm_ring_header_t *>(memory)),
+              data(static_cast<char *>(memory) + sizeof(shm_ring_header_t)), pending(0), capacity(capacity), head(head)
+        {
+        }
+
+        static uint64_t recordSize(size_t size)
+        {
+            return (sizeof(uint32_t) + size + 7) & ~((uint64_t) 7);
+        }
+
+        static long futex(std::atomic<uint32_t> *word, int op, uint32_t value, const struct timespec *timeout)
+        {
+            // not FUTEX_PRIVATE_FLAG, the word is shared between processes
+            return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), op, value, timeout, NULL, 0);
+        }
+
+    public:
+        // Worker side, replaces a segment left by a previous run, NULL and errno on failure
+        static shm_ring *create(const std::string &name, size_t capacity)
+        {
+            capacity = (capacity + 7) & ~((size_t) 7);
+
+            size_t length = sizeof(shm_ring_header_t) + capacity;
+
+            shm_unlink(name.c_str());
+
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+            if (fd < 0)
+            {
+                return NULL;
+            }
+
+            if (ftruncate(fd, length) != 0)
+            {
+                int error = errno;
+
+                close(fd);
+                shm_unlink(name.c_str());
+
+                errno = error;
+
+                return NULL;
+            }
+
+            void *memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+            close(fd);
+
+            if (memory == MAP_FAILED)
+            {
+                shm_unlink(name.c_str());
+
+                return NULL;
+            }
+
+            shm_ring_header_t *header = new (memory) shm_ring_header_t;
+
+            header->capacity = capacity;
+            header->head = 0;
+            header->tail = 0;
+            header->signal = 0;
+            header->sleeping = 0;
+            header->version = SHM_RING_VERSION;
+
+            std::atomic_thread_fence(std::memory_order_release);
+
+            header->magic = SHM_RING_MAGIC;
+
+            return new shm_ring(name, true, length, memory, capacity, 0);
+        }
+
+        // Broker side, NULL and errno on failure
+        static shm_ring *open(const std::string &name)
+        {
+            struct stat info;
+
+            int fd = shm_open(name.c_str(), O_RDWR, 0);
+
+            if (fd < 0)
+            {
+                return NULL;
+            }
+
+            if (fstat(fd, &info) != 0 || (size_t) info.st_size <= sizeof(shm_ring_header_t))
+            {
+                close(fd);
+
+                errno = EINVAL;
+
+                return NULL;
+            }
+
+            void *memory = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+            close(fd);
+
+            if (memory == MAP_FAILED)
+            {
+                return NULL;
+            }
+
+            shm_ring_header_t *header   = static_cast<shm_ring_header_t *>(memory);
+            uint64_t           capacity = header->capacity;
+
+            if (header->magic != SHM_RING_MAGIC || header->version != SHM_RING_VERSION || capacity == 0 ||
+                capacity > (uint64_t) info.st_size - sizeof(shm_ring_header_t) || capacity % 8 != 0)
+            {
+                munmap(memory, info.st_size);
+
+                errno = EINVAL;
+
+                return NULL;
+            }
+
+            return new shm_ring(name, false, info.st_size, memory, capacity, header->head.load(std::memory_order_relaxed));
+        }
+
+        ~shm_ring()
+        {
+            munmap(header, length);
+
+            if (owner)
+            {
+                shm_unlink(name.c_str());
+            }
+        }
+
+        const std::string &getName() const
+        {
+            return name;
+        }
+
+        // Copies the payload into the ring, false when it is full or the payload is too large for it.
+        // Offsets come from the private capacity and head only, a bogus tail from the peer can't move a write out of the buffer.
+        bool push(const void *payload, size_t size)
+        {
+            uint64_t tail     = header->tail.load(std::memory_order_acquire);
+            uint64_t oldest   = head > capacity ? head - capacity : 0;
+            uint64_t need     = recordSize(size);
+            uint64_t position = head % capacity;
+            uint64_t skip     = capacity - position < need ? capacity - position : 0;
+
+            if (tail < oldest || tail > head)
+            {
+                tail = tail < oldest ? oldest : head;
+            }
+
+            if (need > capacity / 4 || head + skip + need - tail > capacity)
+            {
+                return false;
+            }
+
+            if (skip > 0)
+            {
+                uint32_t wrap = SHM_RING_WRAP;
+
+                memcpy(data + position, &wrap, sizeof(wrap));
+
+                head += skip;
+                position = 0;
+            }
+
+            uint32_t size32 = size;
+
+            memcpy(data + position, &size32, sizeof(size32));
+            memcpy(data + position + sizeof(size32), payload, size);
+
+            head += need;
+
+            header->head.store(head, std::memory_order_seq_cst);
+
+            notify();
+
+            return true;
+        }
+
+        // Next record in place, valid until release()
+        bool peek(const char *&payload, size_t &size)
+        {
+            uint64_t tail      = header->tail.load(std::memory_order_relaxed);
+            uint64_t published = header->head.load(std::memory_order_acquire);
+
+            while (tail != published)
+            {
+                uint64_t position = tail % capacity;
+                uint32_t size32;
+
+                memcpy(&size32, data + position, sizeof(size32));
+
+                if (size32 == SHM_RING_WRAP)
+                {
+                    tail += capacity - position;
+
+                    header->tail.store(tail, std::memory_order_release);
+
+                    continue;
+                }
+
+                payload = data + position + sizeof(size32);
+                size = size32;
+                pending = recordSize(size32);
+
+                return true;
+            }
+
+            return false;
+        }
+
+        void release()
+        {
+            header->tail.store(header->tail.load(std::memory_order_relaxed) + pending, std::memory_order_release);
+
+            pending = 0;
+        }
+
+        bool empty() const
+        {
+            return header->head.load(std::memory_order_seq_cst) == header->tail.load(std::memory_order_relaxed);
+        }
+
+        // Consumer found the ring empty and is going to sleep; check for work again after this and before wait()
+        uint32_t prepareWait()
+        {
+            header->sleeping.store(1, std::memory_order_seq_cst);
+
+            return header->signal.load(std::memory_order_seq_cst);
+        }
+
+        void wait(uint32_t signal, int timeoutMs)
+        {
+            struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+
+            futex(&header->signal, FUTEX_WAIT, signal, &timeout);
+
+            finishWait();
+        }
+
+        void finishWait()
+        {
+            header->sleeping.store(0, std::memory_order_relaxed);
+        }
+
+        // Wakes the consumer only if it sleeps, call after publishing work through any channel
+        void notify()
+        {
+            if (header->sleeping.load(std::memory_order_seq_cst))
+            {
+                wake();
+            }
+        }
+
+        void wake()
+        {
+            header->signal.fetch_add(1, std::memory_order_seq_cst);
+
+            futex(&header->signal, FUTEX_WAKE, INT_MAX, NULL);
+        }
+    };
+}
+
+#endif //SERVICE_QUEUE_SHM_RING_H
@@ -0,0 +1,55 @@
+#ifndef SERVICE_QUEUE_SLICE_H
+#define SERVICE_QUEUE_SLICE_H
+
+#include "zmq.hpp"
+#include <string>
+#include <cstring>
+
+using namespace std;
+
+// Bytes owned by someone else (usually a zmq::message_t), never copied
+typedef struct
+{
+    const char *data;
+    size_t      size;
+} slice_t;
+
+inline slice_t sliceOf(const zmq::message_t &message)
+{
+    slice_t slice = {static_cast<const char *>(message.data()), message.size()};
+
+    return slice;
+}
+
+inline slice_t sliceOf(const char *data)
+{
+    slice_t slice = {data, strlen(data)};
+
+    return slice;
+}
+
+inline slice_t sliceOf(const string &str)
+{
+    slice_t slice = {str.data(), str.size()};
+
+    return slice;
+}
+
+inline bool operator == (const slice_t &slice, const string &str)
+{
+    return slice.size == str.size() && 0 == memcmp(slice.data, str.data(), str.size());
+}
+
+inline bool operator == (const slice_t &slice, const char *str)
+{
+    size_t size = strlen(str);
+
+    return slice.size == size && 0 == memcmp(slice.data, str, size);
+}
+
+inline string toString(const slice_t &slice)
+{
+    return string(slice.data, slice.size);
+}
+
+#endif //SERVICE_QUEUE_SLICE_H
@@ -0,0 +1,341 @@
+#include "supervisor.hpp"
+#include "main.hpp"
+#include <sstream>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+extern char **environ;
+
+supervisor::supervisor()
+    : minimum(0), maximum(0), upQueue(0), upWaitMs(0), idleTimeout(0), stopTimeout(0), started(0), backoff(0)
+{
+}
+
+supervisor::~supervisor()
+{
+    killAll();
+}
+
+void supervisor::configure(const string &command, size_t minimum, size_t maximum, size_t upQueue, long upWaitMs,
+                           long idleSec, long stopTimeoutSec)
+{
+    // without a command the children left from before are stopped
+    supervisor::command = command;
+    supervisor::minimum = command.empty() ? 0 : minimum;
+    supervisor::maximum = command.empty() ? 0 : max(maximum, minimum);
+    supervisor::upQueue = upQueue;
+    supervisor::upWaitMs = upWaitMs;
+
+    idleTimeout = chrono::seconds(idleSec);
+    stopTimeout = chrono::seconds(stopTimeoutSec < 1 ? 1 : stopTimeoutSec);
+}
+
+size_t supervisor::running() const
+{
+    size_t count = 0;
+
+    for (vector<child_t>::const_iterator it = children.begin(); it < children.end(); it++)
+    {
+        if (!(*it).stopping)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+bool supervisor::booting(steady_time_t now) const
+{
+    for (vector<child_t>::const_iterator it = children.begin(); it < children.end(); it++)
+    {
+        if (!(*it).stopping && !(*it).registered && (*it).started + chrono::seconds(SUPERVISOR_BOOT_TIMEOUT) > now)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void supervisor::update(steady_time_t now, const supervisor_load_t &load, vector<string> &retire)
+{
+    reap(now);
+
+    while (running() < minimum && now >= nextStart)
+    {
+        if (!spawn(now))
+        {
+            break;
+        }
+    }
+
+    bool pressure = (upWaitMs > 0 && load.waitMs >= upWaitMs) || (upQueue > 0 && load.queued >= upQueue);
+    bool idle     = load.queued == 0 && load.waitMs == 0 && load.inFlight * 2 <= load.credit;
+
+    // a worker still starting up is not counted on yet, starting more for the same spike would overshoot
+    if (pressure && running() < maximum && now >= nextStart && !booting(now))
+    {
+        LOG << "Supervisor: scaling up, " << load.queued << " queued, waiting " << load.waitMs << " ms";
+
+        spawn(now);
+    }
+
+    if (!idle)
+    {
+        idleSince = steady_time_t();
+    }
+    else if (idleSince == steady_time_t())
+    {
+        idleSince = now;
+    }
+
+    bool scaleDown = running() > minimum && idleSince != steady_time_t() && now - idleSince >= idleTimeout;
+
+    if (scaleDown)
+    {
+        LOG << "Supervisor: scaling down, idle for " << chrono::duration_cast<chrono::seconds>(now - idleSince).count() << " s";
+
+        idleSince = now;
+    }
+
+    // the newest ones go first, over maximum after a reload they go without waiting for idle time
+    for (vector<child_t>::reverse_iterator it = children.rbegin(); it != children.rend() && (scaleDown || running() > maximum); it++)
+    {
+        child_t &child = *it;
+
+        if (child.stopping)
+        {
+            continue;
+        }
+
+        child.stopping = true;
+        child.stopSent = now;
+
+        if (child.registered)
+        {
+            retire.push_back(child.id);
+        }
+        else
+        {
+            kill(child.pid, SIGTERM);
+
+            child.signals = 1;
+        }
+
+        scaleDown = false;
+    }
+}
+
+bool supervisor::registered(const string &id)
+{
+    for (vector<child_t>::iterator it = children.begin(); it < children.end(); it++)
+    {
+        if ((*it).id == id)
+        {
+            (*it).registered = true;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void supervisor::terminate(const string &id, steady_time_t now)
+{
+    for (vector<child_t>::iterator it = children.begin(); it < children.end(); it++)
+    {
+        if ((*it).id == id && (*it).signals == 0)
+        {
+            kill((*it).pid, SIGTERM);
+
+            (*it).stopping = true;
+            (*it).stopSent = now;
+            (*it).signals = 1;
+        }
+    }
+}
+
+void supervisor::stopAll(steady_time_t now)
+{
+    for (vector<child_t>::iterator it = children.begin(); it < children.end(); it++)
+    {
+        if ((*it).signals > 0)
+        {
+            continue;
+        }
+
+        kill((*it).pid, SIGTERM);
+
+        (*it).stopping = true;
+        (*it).stopSent = now;
+        (*it).signals = 1;
+    }
+}
+
+void supervisor::killAll()
+{
+    for (vector<child_t>::iterator it = children.begin(); it < children.end(); it++)
+    {
+        ERR << "Supervisor: killing " << (*it).id << " [" << (*it).pid << "]";
+
+        kill((*it).pid, SIGKILL);
+        waitpid((*it).pid, NULL, 0);
+    }
+
+    children.clear();
+}
+
+bool supervisor::spawn(steady_time_t now)
+{
+    char           host[256] = {0};
+    stringstream   id;
+    vector<string> variables;
+    vector<char *> env;
+
+    gethostname(host, sizeof(host) - 1);
+
+    id << "supervised-" << host << "-" << getpid() << "-" << ++started;
+
+    // everything the child needs is prepared here, only async-signal-safe calls are allowed after fork()
+    for (char **it = environ; *it != NULL; it++)
+    {
+        if (strncmp(*it, "SERVICE_QUEUE_WORKER_ID=", 24) != 0)
+        {
+            variables.push_back(*it);
+        }
+    }
+
+    variables.push_back("SERVICE_QUEUE_WORKER_ID=" + id.str());
+
+    for (vector<string>::iterator it = variables.begin(); it < variables.end(); it++)
+    {
+        env.push_back(&(*it)[0]);
+    }
+
+    env.push_back(NULL);
+
+    pid_t parent = getpid();
+    pid_t pid    = fork();
+
+    if (pid < 0)
+    {
+        ERR << "Supervisor: fork failed: " << strerror(errno);
+
+        backoff = chrono::seconds(SUPERVISOR_BACKOFF_MAX);
+        nextStart = now + backoff;
+
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        sigset_t none;
+
+        // the broker's handlers write to its wakeup pipe, a signal before exec must not end up there
+        signal(SIGINT,  SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP,  SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        // the worker goes away with the broker, even when the broker is killed
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+        if (getppid() != parent)
+        {
+            _exit(1);
+        }
+
+        execle("/bin/sh", "sh", "-c", command.c_str(), (char *) NULL, &env[0]);
+
+        _exit(127);
+    }
+
+    child_t child;
+
+    child.id = id.str();
+    child.pid = pid;
+    child.started = now;
+    child.registered = false;
+    child.stopping = false;
+    child.stopSent = steady_time_t();
+    child.signals = 0;
+
+    children.push_back(child);
+
+    LOG << "Supervisor: started " << child.id << " [" << pid << "], " << running() << " running";
+
+    return true;
+}
+
+void supervisor::reap(steady_time_t now)
+{
+    int   status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (vector<child_t>::iterator it = children.begin(); it < children.end(); it++)
+        {
+            if ((*it).pid != pid)
+            {
+                continue;
+            }
+
+            child_t &child = *it;
+
+            if (child.stopping)
+            {
+                LOG << "Supervisor: " << child.id << " [" << pid << "] stopped";
+            }
+            else
+            {
+                ERR << "Supervisor: " << child.id << " [" << pid << "] exited with "
+                    << (WIFSIGNALED(status) ? "signal " : "status ")
+                    << (WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+
+                // a worker that keeps failing right after start is restarted less and less often
+                if (child.started + chrono::seconds(SUPERVISOR_BOOT_TIMEOUT) > now)
+                {
+                    backoff = min(max(backoff * 2, chrono::seconds(1)), chrono::seconds(SUPERVISOR_BACKOFF_MAX));
+                    nextStart = now + backoff;
+                }
+                else
+                {
+                    backoff = chrono::seconds(0);
+                }
+            }
+
+            children.erase(it);
+
+            break;
+        }
+    }
+
+    // shut down through the broker and still running: SIGTERM, then SIGKILL
+    for (vector<child_t>::iterator it = children.begin(); it < children.end(); it++)
+    {
+        child_t &child = *it;
+
+        if (child.stopping && child.signals < 2 && child.stopSent + stopTimeout <= now)
+        {
+            ERR << "Supervisor: " << child.id << " [" << child.pid << "] did not stop, "
+                << (child.signals == 0 ? "terminating" : "killing");
+
+            kill(child.pid, child.signals == 0 ? SIGTERM : SIGKILL);
+
+            child.signals++;
+            child.stopSent = now;
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef SERVICE_QUEUE_SUPERVISOR_H
+#define SERVICE_QUEUE_SUPERVISOR_H
+
+#include "rate_limiter.hpp"
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+using namespace std;
+
+typedef struct
+{
+    string        id;         // SERVICE_QUEUE_WORKER_ID, the worker registers under it
+    pid_t         pid;
+    steady_time_t started;
+    bool          registered;
+    bool          stopping;   // asked to shut down, killed if it does not exit in time
+    steady_time_t stopSent;
+    int           signals;    // SIGTERM, then SIGKILL
+} child_t;
+
+// What the broker sees of the load, sampled once per supervisor interval
+typedef struct
+{
+    size_t queued;   // messages the broker holds and could not hand out yet
+    long   waitMs;   // how long input has been waiting for a free worker, 0 - not waiting
+    size_t inFlight; // in flight on credit workers
+    size_t credit;   // credit of all local workers
+} supervisor_load_t;
+
+// Local worker processes started from a command, between min and max of them. One more is started when input
+// waits for a worker or the queue grows past its threshold; one is stopped only after the broker has been idle
+// with spare credit for a while, and the idle time starts over after each stop, so a spike does not make the
+// number of workers swing back and forth.
+class supervisor
+{
+
+private:
+    string command;
+    size_t minimum;
+    size_t maximum;
+    size_t upQueue;
+    long   upWaitMs;
+
+    chrono::seconds idleTimeout;
+    chrono::seconds stopTimeout;
+
+    vector<child_t> children;
+    unsigned long   started;
+    steady_time_t   idleSince;   // zero - not idle
+    steady_time_t   nextStart;   // crash loop backoff
+    chrono::seconds backoff;
+
+    size_t running() const; // not stopping
+    bool   booting(steady_time_t now) const;
+    bool   spawn(steady_time_t now);
+
+public:
+    supervisor();
+
+    ~supervisor();
+
+    void configure(const string &command, size_t minimum, size_t maximum, size_t upQueue, long upWaitMs,
+                   long idleSec, long stopTimeoutSec);
+
+    bool enabled() const
+    {
+        return !command.empty();
+    }
+
+    // Starts, reaps and kills as needed; ids of children to shut down through the broker go to retire
+    void update(steady_time_t now, const supervisor_load_t &load, vector<string> &retire);
+
+    // A worker registered; true when it is one of ours
+    bool registered(const string &id);
+
+    // Child that is not registered yet and cannot be shut down through the broker
+    void terminate(const string &id, steady_time_t now);
+
+    // Collects children that exited; those asked to stop get SIGTERM, then SIGKILL, stopTimeout apart
+    void reap(steady_time_t now);
+
+    // SIGTERM to every child not signalled yet, reap() collects them and kills those still there after stopTimeout
+    void stopAll(steady_time_t now);
+
+    // SIGKILL to every child left, waits for them
+    void killAll();
+
+    size_t size() const
+    {
+        return children.size();
+    }
+};
+
+#endif //SERVICE_QUEUE_SUPERVISOR_H
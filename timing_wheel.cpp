@@ -0,0 +1,130 @@
+#include "timing_wheel.hpp"
+
+using namespace std;
+
+#define TIMING_WHEEL_MASK (TIMING_WHEEL_SLOTS - 1)
+
+timing_wheel::timing_wheel()
+    : current(0), count(0)
+{
+}
+
+void timing_wheel::push(uint64_t now, uint64_t due, zmq::message_t &payload, uint32_t trace)
+{
+    // nothing pending, so there are no ticks to catch up on
+    if (count == 0 && now > current)
+    {
+        current = now;
+    }
+
+    uint64_t limit = current + ((uint64_t) 1 << (TIMING_WHEEL_BITS * TIMING_WHEEL_LEVELS)) - 1;
+
+    delayed_message_t message = {due <= current ? current + 1 : min(due, limit), move(payload), trace};
+
+    place(message);
+
+    count++;
+}
+
+void timing_wheel::advance(uint64_t now, deque<delayed_message_t> &ready)
+{
+    while (count > 0 && current < now)
+    {
+        current++;
+
+        if ((current & TIMING_WHEEL_MASK) == 0)
+        {
+            cascade(1);
+        }
+
+        vector<delayed_message_t> &slot = slots[0][current & TIMING_WHEEL_MASK];
+
+        for (vector<delayed_message_t>::iterator it = slot.begin(); it != slot.end(); it++)
+        {
+            ready.push_back(move(*it));
+        }
+
+        count -= slot.size();
+
+        slot.clear();
+    }
+
+    if (count == 0 && current < now)
+    {
+        current = now;
+    }
+}
+
+void timing_wheel::takeAll(deque<delayed_message_t> &messages)
+{
+    for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+    {
+        for (int index = 0; index < TIMING_WHEEL_SLOTS; index++)
+        {
+            vector<delayed_message_t> &slot = slots[level][index];
+
+            for (vector<delayed_message_t>::iterator it = slot.begin(); it != slot.end(); it++)
+            {
+                messages.push_back(move(*it));
+            }
+
+            slot.clear();
+        }
+    }
+
+    count = 0;
+}
+
+uint64_t timing_wheel::nextTick() const
+{
+    if (count == 0)
+    {
+        return UINT64_MAX;
+    }
+
+    // level 0 is checked up to the next cascade only, the cascade itself is a wakeup
+    uint64_t boundary = ((current >> TIMING_WHEEL_BITS) + 1) << TIMING_WHEEL_BITS;
+
+    for (uint64_t tick = current + 1; tick < boundary; tick++)
+    {
+        if (!slots[0][tick & TIMING_WHEEL_MASK].empty())
+        {
+            return tick;
+        }
+    }
+
+    return boundary;
+}
+
+void timing_wheel::place(delayed_message_t &message)
+{
+    uint64_t distance = message.due - current;
+    int      level    = 0;
+
+    while (level < TIMING_WHEEL_LEVELS - 1 && distance >= (uint64_t) 1 << (TIMING_WHEEL_BITS * (level + 1)))
+    {
+        level++;
+    }
+
+    slots[level][(message.due >> (TIMING_WHEEL_BITS * level)) & TIMING_WHEEL_MASK].push_back(move(message));
+}
+
+void timing_wheel::cascade(int level)
+{
+    uint64_t index = (current >> (TIMING_WHEEL_BITS * level)) & TIMING_WHEEL_MASK;
+
+    // the level above wraps too, its slot is spread over this one and below first
+    if (index == 0 && level + 1 < TIMING_WHEEL_LEVELS)
+    {
+        cascade(level + 1);
+    }
+
+    vector<delayed_message_t> moving;
+
+    moving.swap(slots[level][index]);
+
+    for (vector<delayed_message_t>::iterator it = moving.begin(); it != moving.end(); it++)
+    {
+        place(*it);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef SERVICE_QUEUE_TIMING_WHEEL_H
+#define SERVICE_QUEUE_TIMING_WHEEL_H
+
+#include "zmq.hpp"
+#include <deque>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// 4 levels of 256 slots with 1 ms ticks reach 2^32 ms (about 49 days), longer delays are cut to that
+#define TIMING_WHEEL_LEVELS 4
+#define TIMING_WHEEL_BITS   8
+#define TIMING_WHEEL_SLOTS  (1 << TIMING_WHEEL_BITS)
+
+typedef struct
+{
+    uint64_t       due; // milliseconds, same clock as passed to timing_wheel
+    zmq::message_t payload;
+    uint32_t       trace; // tracer id, 0 - not sampled
+} delayed_message_t;
+
+// Hierarchical timing wheel: level n slot holds messages due within 256^(n+1) ticks, a slot is moved one level
+// down when the level below wraps around to it. Insertion is O(1), each message is moved at most once per level
+// and nothing is sorted, so millions of pending messages cost about their own size.
+class timing_wheel
+{
+
+private:
+    vector<delayed_message_t> slots[TIMING_WHEEL_LEVELS][TIMING_WHEEL_SLOTS];
+
+    uint64_t current; // last tick handled
+    size_t   count;
+
+    void place(delayed_message_t &message);
+    void cascade(int level);
+
+public:
+    timing_wheel();
+
+    // Takes the payload over, a message already due comes out on the next tick
+    void push(uint64_t now, uint64_t due, zmq::message_t &payload, uint32_t trace);
+
+    // Appends messages due up to now to ready, earliest first
+    void advance(uint64_t now, deque<delayed_message_t> &ready);
+
+    // Appends everything pending to messages in no particular order and empties the wheel
+    void takeAll(deque<delayed_message_t> &messages);
+
+    // Tick when advance() has something to do next, UINT64_MAX when nothing is pending
+    uint64_t nextTick() const;
+
+    size_t size() const
+    {
+        return count;
+    }
+};
+
+#endif //SERVICE_QUEUE_TIMING_WHEEL_H
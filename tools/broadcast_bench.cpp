@@ -0,0 +1,214 @@
+// Measures broadcast fan-out through a running broker with ports.broadcast_input set: registers many workers
+// from one process, sends broadcasts and times until every worker got each of them.
+// usage: service_queue_broadcast_bench [workers] [messages] [payload size] [window]
+//                                      [output DSN] [service DSN] [broadcast DSN]
+
+#include "../zmq.hpp"
+#include "../protocol.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sendService(zmq::socket_t &service, const string &data)
+{
+    zmq::message_t delimiter(0);
+    zmq::message_t message(data.size());
+
+    memcpy(message.data(), data.data(), data.size());
+
+    service.send(delimiter, ZMQ_SNDMORE);
+    service.send(message);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t count     = argc > 1 ? atol(argv[1]) : 1000;
+    size_t messages  = argc > 2 ? atol(argv[2]) : 1000;
+    size_t size      = argc > 3 ? atol(argv[3]) : 100;
+    size_t window    = argc > 4 ? atol(argv[4]) : 16;
+    string output    = argc > 5 ? argv[5] : "tcp://127.0.0.1:8101";
+    string service   = argc > 6 ? argv[6] : "tcp://127.0.0.1:8102";
+    string broadcast = argc > 7 ? argv[7] : "tcp://127.0.0.1:8105";
+
+    size   = max(size, sizeof(uint64_t));
+    window = max(window, (size_t) 1);
+
+    zmq::context_t ctx(1, count * 2 + 16);
+
+    vector<unique_ptr<zmq::socket_t> > outputs;
+    vector<unique_ptr<zmq::socket_t> > services;
+    vector<zmq::pollitem_t>            items;
+    vector<bool>                       pinged(count, false);
+    size_t                             ready = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        stringstream identity;
+        int          linger = 1000;
+
+        // unique per run, the broker may still hold connections of a previous run under the old names
+        identity << "bench-" << getpid() << "-" << i;
+
+        outputs.push_back(unique_ptr<zmq::socket_t>(new zmq::socket_t(ctx, ZMQ_DEALER)));
+        services.push_back(unique_ptr<zmq::socket_t>(new zmq::socket_t(ctx, ZMQ_DEALER)));
+
+        outputs[i]->setsockopt(ZMQ_IDENTITY, identity.str().data(), identity.str().size());
+        services[i]->setsockopt(ZMQ_IDENTITY, identity.str().data(), identity.str().size());
+        services[i]->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+
+        outputs[i]->connect(output.c_str());
+        services[i]->connect(service.c_str());
+
+        zmq::pollitem_t item = {*outputs[i], 0, ZMQ_POLLIN, 0};
+
+        items.push_back(item);
+    }
+
+    // the broker can reach a worker only once its output is connected, so give connects a head start
+    long            settleMs = 1000 + count / 20;
+    struct timespec settle   = {settleMs / 1000, (settleMs % 1000) * 1000000};
+
+    nanosleep(&settle, NULL);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        sendService(*services[i], "{\"action\":\"service.register\"}");
+    }
+
+    zmq::socket_t input(ctx, ZMQ_PUSH);
+
+    input.connect(broadcast.c_str());
+
+    vector<int64_t> sentAt(messages, 0);
+    vector<size_t>  received(messages, 0);
+    vector<int64_t> latencies;
+    size_t          sent      = 0;
+    size_t          completed = 0;
+    size_t          stray     = 0;
+    int64_t         started   = 0;
+    int64_t         deadline  = nowNs() + (int64_t) 60 * 1000000000;
+
+    // the broker pings a worker right after it registers, so the first ping means it is reachable
+    while (completed < messages && nowNs() < deadline)
+    {
+        while (ready == count && sent < messages && sent - completed < window)
+        {
+            zmq::message_t payload(size);
+            uint64_t       seq = sent;
+
+            memset(payload.data(), 0, size);
+            memcpy(payload.data(), &seq, sizeof(seq));
+
+            sentAt[sent++] = nowNs();
+
+            input.send(payload);
+        }
+
+        size_t got = 0;
+
+        // polling thousands of sockets costs more than trying each of them, so poll only when all are idle
+        for (size_t i = 0; i < count; i++)
+        {
+            zmq::message_t message;
+
+            while (outputs[i]->recv(&message, ZMQ_DONTWAIT))
+            {
+                got++;
+
+                if (isControlMessage(message, "ping"))
+                {
+                    sendService(*services[i], "{\"action\":\"pong\"}");
+
+                    if (!pinged[i])
+                    {
+                        pinged[i] = true;
+
+                        if (++ready == count)
+                        {
+                            cerr << count << " workers registered" << endl;
+
+                            started = nowNs();
+                        }
+                    }
+
+                    continue;
+                }
+
+                uint64_t seq;
+
+                memcpy(&seq, message.data(), sizeof(seq));
+
+                if (message.size() != size || seq >= sent)
+                {
+                    stray++;
+
+                    continue;
+                }
+
+                if (++received[seq] == count)
+                {
+                    latencies.push_back(nowNs() - sentAt[seq]);
+
+                    completed++;
+                }
+            }
+        }
+
+        if (got == 0)
+        {
+            zmq::poll(&items[0], items.size(), 100);
+        }
+    }
+
+    int64_t elapsed = nowNs() - started;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        sendService(*services[i], "{\"action\":\"service.shutdown\"}");
+    }
+
+    if (ready < count || latencies.empty())
+    {
+        cerr << "timed out: " << ready << " of " << count << " workers ready, " << completed << " of " << messages
+             << " broadcasts complete" << endl;
+
+        return 1;
+    }
+
+    sort(latencies.begin(), latencies.end());
+
+    double seconds = elapsed / 1e9;
+
+    cout << count << " workers, " << completed << " broadcasts of " << size << " bytes, window " << window << endl
+         << fixed << setprecision(0)
+         << setw(12) << completed / seconds << " broadcasts/s" << endl
+         << setw(12) << completed * count / seconds << " deliveries/s" << endl
+         << setprecision(2)
+         << setw(12) << latencies[latencies.size() / 2] / 1e6 << " ms p50 until the last worker got it" << endl
+         << setw(12) << latencies[latencies.size() * 99 / 100] / 1e6 << " ms p99" << endl;
+
+    if (stray > 0)
+    {
+        cout << setw(12) << stray << " unexpected messages" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Asks a running broker for its state or takes a worker out of dispatch, through the service socket.
+// usage: service_queue_ctl status [--service <DSN>] [--timeout <ms>]
+//        service_queue_ctl drain|quarantine|release <worker> [--service <DSN>] [--timeout <ms>]
+
+#include "../zmq.hpp"
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+static void usage()
+{
+    cerr << "usage: service_queue_ctl status [--service <DSN>] [--timeout <ms>]" << endl
+         << "       service_queue_ctl drain|quarantine|release <worker> [--service <DSN>] [--timeout <ms>]" << endl
+         << endl
+         << "  status      workers with their state, credit and ping round trip, queue depths, scheduler, counters" << endl
+         << "  drain       no new messages for the worker, it is shut down once those in flight are done" << endl
+         << "  quarantine  no new messages for the worker until released, it stays registered" << endl
+         << "  release     back to dispatch after quarantine or a drain still waiting" << endl;
+}
+
+static string escape(const string &value)
+{
+    string escaped;
+
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        if (value[i] == '"' || value[i] == '\\')
+        {
+            escaped += '\\';
+        }
+
+        escaped += value[i];
+    }
+
+    return escaped;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        usage();
+
+        return 1;
+    }
+
+    string command = argv[1];
+    string worker;
+    string dsn     = "tcp://127.0.0.1:8102";
+    int    timeout = 3000;
+    int    first   = 2;
+
+    if (command != "status")
+    {
+        if ((command != "drain" && command != "quarantine" && command != "release") || argc < 3)
+        {
+            usage();
+
+            return 1;
+        }
+
+        worker = argv[2];
+        first = 3;
+    }
+
+    for (int i = first; i < argc; i++)
+    {
+        string option = argv[i];
+
+        if (i + 1 >= argc)
+        {
+            usage();
+
+            return 1;
+        }
+        else if (option == "--service")
+        {
+            dsn = argv[++i];
+        }
+        else if (option == "--timeout")
+        {
+            timeout = atoi(argv[++i]);
+        }
+        else
+        {
+            usage();
+
+            return 1;
+        }
+    }
+
+    string request = "{\"action\":\"admin." + command + "\"" +
+                     (worker.empty() ? "" : ",\"worker\":\"" + escape(worker) + "\"") + "}";
+
+    zmq::context_t ctx(1);
+    zmq::socket_t  service(ctx, ZMQ_DEALER);
+    int            linger = 0;
+
+    service.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    service.setsockopt(ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    service.connect(dsn.c_str());
+
+    zmq::message_t delimiter(0);
+    zmq::message_t message(request.size());
+
+    memcpy(message.data(), request.data(), request.size());
+
+    service.send(delimiter, ZMQ_SNDMORE);
+    service.send(message);
+
+    // [delimiter][reply]
+    zmq::message_t reply;
+
+    if (!service.recv(&reply) || (reply.size() == 0 && !service.recv(&reply)))
+    {
+        cerr << "No answer from " << dsn << " in " << timeout << " ms" << endl;
+
+        return 1;
+    }
+
+    string answer(static_cast<const char *>(reply.data()), reply.size());
+
+    cout << answer << endl;
+
+    return answer.find("\"error\"") == string::npos ? 0 : 1;
+}
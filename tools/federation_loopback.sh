@@ -0,0 +1,51 @@
+#!/bin/sh
+# Two federated brokers on loopback: "front" has no workers and overflows everything to "back", which lists front
+# as a peer and has the soak test's workers. Fails unless every message arrives exactly once.
+# usage: tools/federation_loopback.sh [build dir] [seconds] [messages/s]
+
+BUILD=${1:-.}
+DURATION=${2:-10}
+RATE=${3:-2000}
+
+cd "$BUILD" || exit 1
+
+if [ ! -x ./service_queue ] || [ ! -x ./service_queue_soak ] || [ ! -f default/config.json ]; then
+    echo "service_queue, service_queue_soak and default/config.json expected in $BUILD" >&2
+    exit 1
+fi
+
+# config dir: ports from default/config.json moved to base, base + 1, base + 2, and a federation section
+configure()
+{
+    mkdir -p "$1"
+
+    sed -e "s|127.0.0.1:8100|127.0.0.1:$2|" -e "s|127.0.0.1:8101|127.0.0.1:$(($2 + 1))|" \
+        -e "s|127.0.0.1:8102|127.0.0.1:$(($2 + 2))|" -e '$d' default/config.json > "$1/config.json"
+
+    printf '  ,"federation" : { "name": "%s", "credit": 100, "peers": [%s] }\n}\n' "$1" "$3" >> "$1/config.json"
+}
+
+configure federation_front 8300 ""
+configure federation_back 8310 '{"output": "tcp://127.0.0.1:8301", "service": "tcp://127.0.0.1:8302"}'
+
+./service_queue federation_front > /dev/null 2>&1 &
+FRONT=$!
+
+./service_queue federation_back > /dev/null 2>&1 &
+BACK=$!
+
+trap 'kill -INT $FRONT $BACK 2> /dev/null; wait' EXIT
+
+# back registers with front as a pseudo-worker
+sleep 1
+
+./service_queue_soak "$DURATION" "$RATE" 4 0 0 "$FRONT" \
+    tcp://127.0.0.1:8300 tcp://127.0.0.1:8311 tcp://127.0.0.1:8312 | tee federation_loopback.out
+
+if grep -q "lost 0, duplicates 0" federation_loopback.out && ! grep -q "^sent 0," federation_loopback.out; then
+    echo "federation: ok"
+    exit 0
+fi
+
+echo "federation: FAILED, see federation_front/ and federation_back/ logs" >&2
+exit 1
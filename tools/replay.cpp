@@ -0,0 +1,291 @@
+// Streams dead letters back into the broker input.
+// usage: service_queue_replay <dead letter dir> <input DSN> [--from <unix time>] [--to <unix time>]
+//                             [--worker <identity>] [--rate <messages/s>] [--list]
+
+#include "../zmq.hpp"
+#include "../dead_letters.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+typedef struct
+{
+    const char *data;
+    size_t      size;
+} mapping_t;
+
+static bool mapFile(const string &path, mapping_t &mapping)
+{
+    struct stat info;
+
+    int fd = open(path.c_str(), O_RDONLY);
+
+    mapping.data = NULL;
+    mapping.size = 0;
+
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    mapping.size = info.st_size;
+
+    if (mapping.size > 0)
+    {
+        void *memory = mmap(NULL, mapping.size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (memory == MAP_FAILED)
+        {
+            close(fd);
+
+            return false;
+        }
+
+        madvise(memory, mapping.size, MADV_SEQUENTIAL);
+
+        mapping.data = static_cast<const char *>(memory);
+    }
+
+    close(fd);
+
+    return true;
+}
+
+static void unmapFile(mapping_t &mapping)
+{
+    if (mapping.data != NULL)
+    {
+        munmap(const_cast<char *>(mapping.data), mapping.size);
+    }
+}
+
+static bool indexBefore(const dead_letter_index_t &entry, uint64_t time)
+{
+    return entry.time < time;
+}
+
+static void usage()
+{
+    cerr << "usage: service_queue_replay <dead letter dir> <input DSN> [--from <unix time>] [--to <unix time>]" << endl
+         << "                            [--worker <identity>] [--rate <messages/s>] [--list]" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        usage();
+
+        return 1;
+    }
+
+    string   directory = argv[1];
+    string   dsn       = argv[2];
+    uint64_t from      = 0;
+    uint64_t to        = UINT64_MAX;
+    string   worker;
+    bool     filtered  = false;
+    double   rate      = 0;
+    bool     list      = false;
+
+    for (int i = 3; i < argc; i++)
+    {
+        string option = argv[i];
+
+        if (option == "--list")
+        {
+            list = true;
+        }
+        else if (i + 1 >= argc)
+        {
+            usage();
+
+            return 1;
+        }
+        else if (option == "--from")
+        {
+            from = (uint64_t) (atof(argv[++i]) * 1000000);
+        }
+        else if (option == "--to")
+        {
+            to = (uint64_t) (atof(argv[++i]) * 1000000);
+        }
+        else if (option == "--worker")
+        {
+            worker = argv[++i];
+            filtered = true;
+        }
+        else if (option == "--rate")
+        {
+            rate = atof(argv[++i]);
+        }
+        else
+        {
+            usage();
+
+            return 1;
+        }
+    }
+
+    vector<string> segments;
+    DIR           *dir = opendir(directory.c_str());
+
+    if (dir == NULL)
+    {
+        cerr << directory << ": " << strerror(errno) << endl;
+
+        return 1;
+    }
+
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir))
+    {
+        string name = entry->d_name;
+        size_t size = strlen(DEAD_LETTER_IDX_SUFFIX);
+
+        if (name.size() > size && name.compare(name.size() - size, size, DEAD_LETTER_IDX_SUFFIX) == 0)
+        {
+            segments.push_back(name.substr(0, name.size() - size));
+        }
+    }
+
+    closedir(dir);
+
+    // names are zero padded start times, so they sort in time order
+    sort(segments.begin(), segments.end());
+
+    zmq::context_t ctx(1);
+    zmq::socket_t  input(ctx, ZMQ_PUSH);
+
+    if (!list)
+    {
+        input.connect(dsn.c_str());
+    }
+
+    uint32_t workerHash = deadLetterHash(worker.data(), worker.size());
+    uint64_t replayed   = 0;
+    uint64_t bytes      = 0;
+
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    for (size_t s = 0; s < segments.size(); s++)
+    {
+        // a segment holds nothing newer than the start of the next one
+        if (s + 1 < segments.size() && strtoull(segments[s + 1].c_str(), NULL, 10) < from)
+        {
+            continue;
+        }
+
+        if (strtoull(segments[s].c_str(), NULL, 10) > to)
+        {
+            break;
+        }
+
+        mapping_t log;
+        mapping_t index;
+
+        if (!mapFile(directory + "/" + segments[s] + DEAD_LETTER_LOG_SUFFIX, log) ||
+            !mapFile(directory + "/" + segments[s] + DEAD_LETTER_IDX_SUFFIX, index))
+        {
+            cerr << segments[s] << ": " << strerror(errno) << endl;
+
+            unmapFile(log);
+
+            continue;
+        }
+
+        const dead_letter_index_t *first = reinterpret_cast<const dead_letter_index_t *>(index.data);
+        const dead_letter_index_t *last  = first + index.size / sizeof(dead_letter_index_t);
+
+        for (const dead_letter_index_t *entry = lower_bound(first, last, from, indexBefore); entry < last && entry->time <= to; entry++)
+        {
+            if (filtered && entry->worker != workerHash)
+            {
+                continue;
+            }
+
+            dead_letter_header_t header;
+
+            // the index can be flushed ahead of the log while the broker is running
+            if (entry->offset + sizeof(header) > log.size)
+            {
+                break;
+            }
+
+            memcpy(&header, log.data + entry->offset, sizeof(header));
+
+            const char *identity = log.data + entry->offset + sizeof(header);
+            const char *payload  = identity + header.workerSize;
+
+            if (entry->offset + sizeof(header) + header.workerSize + header.size > log.size)
+            {
+                break;
+            }
+
+            if (filtered && (header.workerSize != worker.size() || memcmp(identity, worker.data(), worker.size()) != 0))
+            {
+                continue;
+            }
+
+            if (list)
+            {
+                cout << header.time / 1000000 << "." << setw(6) << setfill('0') << header.time % 1000000 << setfill(' ')
+                     << " " << string(identity, header.workerSize)
+                     << " " << (header.reason == DEAD_SEND_FAILED ? "send_failed" :
+                                header.reason == DEAD_WORKER_LOST ? "worker_lost" : "not_due")
+                     << " " << header.size << endl;
+            }
+            else
+            {
+                if (rate > 0)
+                {
+                    chrono::steady_clock::time_point due = started + chrono::microseconds((uint64_t) (replayed * 1000000 / rate));
+
+                    if (due > chrono::steady_clock::now())
+                    {
+                        this_thread::sleep_until(due);
+                    }
+                }
+
+                zmq::message_t message(header.size);
+
+                memcpy(message.data(), payload, header.size);
+
+                input.send(message);
+            }
+
+            replayed++;
+            bytes += header.size;
+        }
+
+        unmapFile(log);
+        unmapFile(index);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    cerr << (list ? "listed " : "replayed ") << replayed << " messages, " << bytes << " bytes in " << seconds << " s" << endl;
+
+    input.close();
+    ctx.close();
+
+    return 0;
+}
@@ -0,0 +1,240 @@
+// Compares the shared memory ring with ipc and tcp sockets between two processes on one host.
+// usage: service_queue_shm_bench [messages] [payload size] [pace us]
+
+#include "../zmq.hpp"
+#include "../shm_ring.hpp"
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+using namespace std;
+using service_queue::shm_ring;
+
+#define BENCH_RING_SIZE (8 * 1024 * 1024)
+#define BENCH_IPC_DSN   "ipc:///tmp/service_queue_shm_bench.ipc"
+#define BENCH_TCP_DSN   "tcp://127.0.0.1:18199"
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stamp(vector<char> &payload)
+{
+    int64_t now = nowNs();
+
+    memcpy(&payload[0], &now, sizeof(now));
+}
+
+static void report(const string &transport, const string &mode, vector<int64_t> &latencies, int64_t elapsed, size_t size)
+{
+    sort(latencies.begin(), latencies.end());
+
+    double total = 0;
+
+    for (size_t i = 0; i < latencies.size(); i++)
+    {
+        total += latencies[i];
+    }
+
+    double seconds = elapsed / 1e9;
+
+    cout << setw(4) << transport << " " << setw(10) << mode
+         << fixed << setprecision(0) << setw(12) << latencies.size() / seconds << " msg/s"
+         << setprecision(1) << setw(9) << latencies.size() * size / seconds / 1048576 << " MB/s"
+         << setprecision(2) << setw(10) << total / latencies.size() / 1000 << " us avg"
+         << setw(10) << latencies[latencies.size() / 2] / 1000.0 << " us p50"
+         << setw(10) << latencies[latencies.size() * 99 / 100] / 1000.0 << " us p99" << endl;
+}
+
+// Consumer runs in the child, producer in the parent; pace 0 sends as fast as possible
+static void runShm(size_t messages, size_t size, long pace)
+{
+    shm_ring *ring = shm_ring::create("/service_queue_shm_bench", BENCH_RING_SIZE);
+
+    if (ring == NULL)
+    {
+        cerr << "shm: " << strerror(errno) << endl;
+
+        return;
+    }
+
+    pid_t child = fork();
+
+    if (child == 0)
+    {
+        vector<int64_t> latencies;
+        int64_t         started = 0;
+
+        latencies.reserve(messages);
+
+        while (latencies.size() < messages)
+        {
+            const char *payload;
+            size_t      length;
+
+            if (!ring->peek(payload, length))
+            {
+                uint32_t signal = ring->prepareWait();
+
+                if (ring->empty())
+                {
+                    ring->wait(signal, 100);
+                }
+                else
+                {
+                    ring->finishWait();
+                }
+
+                continue;
+            }
+
+            int64_t sent;
+
+            memcpy(&sent, payload, sizeof(sent));
+
+            ring->release();
+
+            int64_t now = nowNs();
+
+            if (started == 0)
+            {
+                started = now;
+            }
+
+            latencies.push_back(now - sent);
+        }
+
+        report("shm", pace > 0 ? "paced" : "saturated", latencies, nowNs() - started, size);
+
+        _exit(0);
+    }
+
+    vector<char> payload(size);
+    int64_t      next = nowNs();
+
+    for (size_t i = 0; i < messages; i++)
+    {
+        while (pace > 0 && nowNs() < next)
+        {
+        }
+
+        next += pace * 1000;
+
+        stamp(payload);
+
+        while (!ring->push(&payload[0], size))
+        {
+            sched_yield();
+        }
+    }
+
+    waitpid(child, NULL, 0);
+
+    delete ring;
+}
+
+static void runSocket(const string &transport, const char *dsn, size_t messages, size_t size, long pace)
+{
+    pid_t child = fork();
+
+    if (child == 0)
+    {
+        zmq::context_t  ctx(1);
+        zmq::socket_t   pull(ctx, ZMQ_PULL);
+        vector<int64_t> latencies;
+        int64_t         started = 0;
+
+        latencies.reserve(messages);
+
+        pull.bind(dsn);
+
+        while (latencies.size() < messages)
+        {
+            zmq::message_t message;
+            int64_t        sent;
+
+            pull.recv(&message);
+
+            memcpy(&sent, message.data(), sizeof(sent));
+
+            int64_t now = nowNs();
+
+            if (started == 0)
+            {
+                started = now;
+            }
+
+            latencies.push_back(now - sent);
+        }
+
+        report(transport, pace > 0 ? "paced" : "saturated", latencies, nowNs() - started, size);
+
+        pull.close();
+        ctx.close();
+
+        _exit(0);
+    }
+
+    zmq::context_t ctx(1);
+    zmq::socket_t  push(ctx, ZMQ_PUSH);
+    vector<char>   payload(size);
+
+    push.connect(dsn);
+
+    int64_t next = nowNs();
+
+    for (size_t i = 0; i < messages; i++)
+    {
+        while (pace > 0 && nowNs() < next)
+        {
+        }
+
+        next += pace * 1000;
+
+        stamp(payload);
+
+        zmq::message_t message(size);
+
+        memcpy(message.data(), &payload[0], size);
+
+        push.send(message);
+    }
+
+    waitpid(child, NULL, 0);
+
+    push.close();
+    ctx.close();
+}
+
+int main(int argc, char* argv[])
+{
+    size_t messages = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t size     = argc > 2 ? atol(argv[2]) : 100;
+    long   pace     = argc > 3 ? atol(argv[3]) : 20;
+
+    size = max(size, sizeof(int64_t));
+
+    cout << messages << " messages of " << size << " bytes, paced runs send one per " << pace << " us" << endl;
+
+    runShm(messages, size, 0);
+    runSocket("ipc", BENCH_IPC_DSN, messages, size, 0);
+    runSocket("tcp", BENCH_TCP_DSN, messages, size, 0);
+
+    size_t pacedMessages = min(messages, (size_t) 100000);
+
+    runShm(pacedMessages, size, pace);
+    runSocket("ipc", BENCH_IPC_DSN, pacedMessages, size, pace);
+    runSocket("tcp", BENCH_TCP_DSN, pacedMessages, size, pace);
+
+    return 0;
+}
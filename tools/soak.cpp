@@ -0,0 +1,411 @@
+// Soak test for worker churn: sends sustained load through a running broker while fake workers register and die
+// (some unregister, the rest just vanish) at a given rate, and reports throughput, dispatch latency, lost messages
+// and broker memory every second and for the whole run.
+// usage: service_queue_soak [seconds] [messages/s] [stable workers] [churned workers/s] [vanishing %] [broker pid]
+//                           [input DSN] [output DSN] [service DSN]
+
+#include "../zmq.hpp"
+#include "../protocol.hpp"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define SOAK_CREDIT        16
+#define SOAK_PAYLOAD       64
+#define SOAK_SETTLE_MS     100  // between connecting and registering, so the broker can reach the worker at once
+#define SOAK_GRACE_MS      500  // an unregistered worker still reads this long to catch late deliveries
+#define SOAK_MIN_LIFE_MS   200
+#define SOAK_MAX_LIFE_MS   2000
+#define SOAK_DRAIN_SECONDS 3
+
+typedef struct
+{
+    string                   identity;
+    unique_ptr<zmq::socket_t> output;
+    unique_ptr<zmq::socket_t> service;
+    int64_t                  registerAt;
+    int64_t                  dieAt;        // 0 - lives through the run
+    int64_t                  closeAt;      // set once unregistered
+    bool                     graceful;
+    bool                     registered;
+} fake_worker_t;
+
+typedef struct
+{
+    uint64_t        received;
+    uint64_t        spawned;
+    uint64_t        killed;
+    vector<int64_t> latencies;
+} interval_t;
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long rssMb(long pid)
+{
+    stringstream path;
+    string       line;
+
+    path << "/proc/" << pid << "/status";
+
+    ifstream status(path.str().c_str());
+
+    while (getline(status, line))
+    {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+        {
+            return atol(line.c_str() + 6) / 1024;
+        }
+    }
+
+    return -1;
+}
+
+static void sendService(zmq::socket_t &service, const string &data)
+{
+    zmq::message_t delimiter(0);
+    zmq::message_t message(data.size());
+
+    memcpy(message.data(), data.data(), data.size());
+
+    service.send(delimiter, ZMQ_SNDMORE);
+    service.send(message);
+}
+
+static double percentile(vector<int64_t> &values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+
+    size_t index = min(values.size() - 1, (size_t) (values.size() * p));
+
+    nth_element(values.begin(), values.begin() + index, values.end());
+
+    return values[index] / 1e6;
+}
+
+static void produce(zmq::context_t *ctx, string dsn, double rate, int64_t until, atomic<uint64_t> *sent)
+{
+    zmq::socket_t input(*ctx, ZMQ_PUSH);
+    int           linger  = 0;
+    int           timeout = 100;
+
+    input.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    input.setsockopt(ZMQ_SNDTIMEO, &timeout, sizeof(timeout));
+    input.connect(dsn.c_str());
+
+    int64_t  started = nowNs();
+    uint64_t seq     = 0;
+
+    while (nowNs() < until)
+    {
+        uint64_t target = (uint64_t) ((nowNs() - started) / 1e9 * rate);
+
+        // the broker may block input while it has no worker, sending stalls then and shows up as a dip
+        for (; seq < target && nowNs() < until; seq++)
+        {
+            zmq::message_t payload(SOAK_PAYLOAD);
+            int64_t        stamp = nowNs();
+
+            memset(payload.data(), 0, SOAK_PAYLOAD);
+            memcpy(payload.data(), &seq, sizeof(seq));
+            memcpy(static_cast<char *>(payload.data()) + sizeof(seq), &stamp, sizeof(stamp));
+
+            if (!input.send(payload))
+            {
+                break;
+            }
+
+            sent->store(seq + 1);
+        }
+
+        usleep(1000);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    long   seconds = argc > 1 ? atol(argv[1]) : 60;
+    double rate    = argc > 2 ? atof(argv[2]) : 20000;
+    size_t stable  = argc > 3 ? atol(argv[3]) : 8;
+    double churn   = argc > 4 ? atof(argv[4]) : 200;
+    long   vanish  = argc > 5 ? atol(argv[5]) : 50;
+    long   pid     = argc > 6 ? atol(argv[6]) : 0;
+    string input   = argc > 7 ? argv[7] : "tcp://127.0.0.1:8100";
+    string output  = argc > 8 ? argv[8] : "tcp://127.0.0.1:8101";
+    string service = argc > 9 ? argv[9] : "tcp://127.0.0.1:8102";
+
+    // churned workers live about a second and are kept for the grace period, four sockets of headroom each
+    zmq::context_t ctx(1, (int) (4 * (stable + churn * 3) + 64));
+
+    vector<unique_ptr<fake_worker_t> > workers;
+    vector<bool>                       seen;
+    vector<interval_t>                 intervals(1);
+    vector<int64_t>                    allLatencies;
+    vector<long>                       rss;
+    minstd_rand                        rng(getpid());
+    uint64_t                           delivered  = 0;
+    uint64_t                           duplicates = 0;
+    uint64_t                           late       = 0;
+    uint64_t                           created    = 0;
+    uint64_t                           previous   = 0;
+    double                             spawnDebt  = 0;
+    atomic<uint64_t>                   sent(0);
+
+    int64_t started   = nowNs();
+    int64_t loadStart = started + (int64_t) SOAK_SETTLE_MS * 2 * 1000000;
+    int64_t loadEnd   = loadStart + (int64_t) seconds * 1000000000;
+    int64_t end       = loadEnd + (int64_t) SOAK_DRAIN_SECONDS * 1000000000;
+    int64_t lastSpawn = started;
+    int64_t nextTick  = loadStart + 1000000000;
+
+    thread producer(produce, &ctx, input, rate, loadEnd, &sent);
+
+    if (pid > 0)
+    {
+        rss.push_back(rssMb(pid));
+    }
+
+    cout << "   t  sent/s  recv/s   p50 ms   p99 ms   max ms  workers  spawned  killed  broker MB" << endl;
+
+    while (nowNs() < end)
+    {
+        int64_t now = nowNs();
+
+        // stable workers first, churn at the given rate while load runs
+        spawnDebt += workers.empty() ? stable : (now < loadEnd ? churn * (now - lastSpawn) / 1e9 : 0);
+        lastSpawn = now;
+
+        for (; spawnDebt >= 1; spawnDebt--)
+        {
+            unique_ptr<fake_worker_t> worker(new fake_worker_t());
+            stringstream              identity;
+            int                       linger = 0;
+
+            identity << "soak-" << getpid() << "-" << created;
+
+            worker->identity = identity.str();
+            worker->output.reset(new zmq::socket_t(ctx, ZMQ_DEALER));
+            worker->service.reset(new zmq::socket_t(ctx, ZMQ_DEALER));
+            worker->registerAt = now + (int64_t) SOAK_SETTLE_MS * 1000000;
+            worker->dieAt = created < stable ? 0 : worker->registerAt +
+                            (int64_t) (SOAK_MIN_LIFE_MS + rng() % (SOAK_MAX_LIFE_MS - SOAK_MIN_LIFE_MS)) * 1000000;
+            worker->closeAt = 0;
+            worker->graceful = (long) (rng() % 100) >= vanish;
+            worker->registered = false;
+
+            worker->output->setsockopt(ZMQ_IDENTITY, worker->identity.data(), worker->identity.size());
+            worker->service->setsockopt(ZMQ_IDENTITY, worker->identity.data(), worker->identity.size());
+            worker->output->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+            worker->service->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+            worker->output->connect(output.c_str());
+            worker->service->connect(service.c_str());
+
+            if (created >= stable)
+            {
+                intervals.back().spawned++;
+            }
+
+            workers.push_back(move(worker));
+
+            created++;
+        }
+
+        size_t got = 0;
+
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            fake_worker_t &worker = *workers[i];
+
+            if (!worker.registered && worker.registerAt <= now)
+            {
+                sendService(*worker.service, "{\"action\":\"service.register\",\"credit\":" + to_string(SOAK_CREDIT) + "}");
+
+                worker.registered = true;
+            }
+
+            zmq::message_t message;
+            unsigned int   done = 0;
+
+            while (worker.output->recv(&message, ZMQ_DONTWAIT))
+            {
+                got++;
+
+                if (isControlMessage(message, "ping"))
+                {
+                    if (worker.closeAt == 0)
+                    {
+                        sendService(*worker.service, "{\"action\":\"pong\"}");
+                    }
+
+                    continue;
+                }
+
+                if (message.size() != SOAK_PAYLOAD)
+                {
+                    continue;
+                }
+
+                uint64_t seq;
+                int64_t  stamp;
+
+                memcpy(&seq, message.data(), sizeof(seq));
+                memcpy(&stamp, static_cast<const char *>(message.data()) + sizeof(seq), sizeof(stamp));
+
+                if (seq >= seen.size())
+                {
+                    seen.resize(seq + 1 + seen.size() / 2, false);
+                }
+
+                if (seen[seq])
+                {
+                    duplicates++;
+                }
+                else
+                {
+                    seen[seq] = true;
+                    delivered++;
+                }
+
+                if (worker.closeAt != 0)
+                {
+                    late++;
+                }
+
+                intervals.back().received++;
+                intervals.back().latencies.push_back(nowNs() - stamp);
+
+                done++;
+            }
+
+            if (done > 0 && worker.closeAt == 0)
+            {
+                sendService(*worker.service, "{\"action\":\"done\",\"count\":" + to_string(done) + "}");
+            }
+        }
+
+        // dying workers unregister and keep reading a while, or disappear without a word
+        for (vector<unique_ptr<fake_worker_t> >::iterator it = workers.begin(); it != workers.end();)
+        {
+            fake_worker_t &worker = **it;
+
+            if (worker.closeAt == 0 && worker.dieAt != 0 && worker.dieAt <= now)
+            {
+                intervals.back().killed++;
+
+                if (worker.graceful)
+                {
+                    sendService(*worker.service, "{\"action\":\"service.shutdown\"}");
+
+                    worker.closeAt = now + (int64_t) SOAK_GRACE_MS * 1000000;
+                }
+                else
+                {
+                    worker.closeAt = now;
+                }
+            }
+
+            if (worker.closeAt != 0 && worker.closeAt <= now)
+            {
+                it = workers.erase(it);
+            }
+            else
+            {
+                it++;
+            }
+        }
+
+        if (now >= nextTick)
+        {
+            interval_t &last   = intervals.back();
+            double      second = (double) (intervals.size());
+            uint64_t    total  = sent.load();
+
+            allLatencies.insert(allLatencies.end(), last.latencies.begin(), last.latencies.end());
+
+            if (pid > 0)
+            {
+                rss.push_back(rssMb(pid));
+            }
+
+            cout << setw(4) << (long) second << setw(8) << total - previous << setw(8) << last.received
+                 << fixed << setprecision(2)
+                 << setw(9) << percentile(last.latencies, 0.5) << setw(9) << percentile(last.latencies, 0.99)
+                 << setw(9) << percentile(last.latencies, 1.0)
+                 << setw(9) << workers.size() << setw(9) << last.spawned << setw(8) << last.killed
+                 << setw(11) << (pid > 0 ? rss.back() : -1) << endl;
+
+            previous = total;
+
+            intervals.push_back(interval_t());
+            intervals.back().received = intervals.back().spawned = intervals.back().killed = 0;
+
+            nextTick += 1000000000;
+        }
+
+        if (got == 0)
+        {
+            usleep(500);
+        }
+    }
+
+    producer.join();
+
+    // whole seconds under load only, the first one warms up and the drain tail has no input
+    vector<uint64_t> throughput;
+
+    for (size_t i = 1; i + 1 < intervals.size() && (int64_t) i < seconds; i++)
+    {
+        throughput.push_back(intervals[i].received);
+    }
+
+    sort(throughput.begin(), throughput.end());
+
+    uint64_t total = sent.load();
+
+    cout << endl
+         << "sent " << total << ", delivered " << delivered << ", lost " << total - min(total, delivered)
+         << ", duplicates " << duplicates << ", after unregister " << late << endl;
+
+    if (!throughput.empty())
+    {
+        uint64_t median = throughput[throughput.size() / 2];
+
+        cout << "throughput/s min " << throughput.front() << ", median " << median << ", max " << throughput.back()
+             << ", worst dip " << fixed << setprecision(1)
+             << (median > 0 ? 100.0 * (median - throughput.front()) / median : 0) << "%" << endl;
+    }
+
+    cout << "latency ms p50 " << setprecision(2) << percentile(allLatencies, 0.5) << ", p99 "
+         << percentile(allLatencies, 0.99) << ", p99.9 " << percentile(allLatencies, 0.999) << ", max "
+         << percentile(allLatencies, 1.0) << endl;
+
+    if (rss.size() > 1)
+    {
+        cout << "broker rss MB start " << rss.front() << ", end " << rss.back() << ", peak "
+             << *max_element(rss.begin(), rss.end()) << endl;
+    }
+
+    return 0;
+}
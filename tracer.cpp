@@ -0,0 +1,154 @@
+#include "tracer.hpp"
+#include "json_scanner.hpp"
+#include <fstream>
+#include <iomanip>
+#include <map>
+
+using namespace std;
+
+// span ending at the stage, named after what the message was waiting for
+static const char *spanNames[] = {"received", "rate limit", "wait for worker", "send", "worker", "lost", "ack"};
+
+static void writeEvent(ostream &out, bool &first, const char *phase, const char *name, uint32_t id, int64_t time,
+                       const string *worker)
+{
+    out << (first ? "\n" : ",\n")
+        << "{\"name\":\"" << name << "\",\"cat\":\"message\",\"ph\":\"" << phase << "\",\"id\":" << id
+        << ",\"pid\":1,\"tid\":1,\"ts\":" << time / 1000 << "." << setw(3) << setfill('0') << time % 1000 << setfill(' ');
+
+    if (worker != NULL)
+    {
+        out << ",\"args\":{\"worker\":";
+
+        writeJsonString(out, *worker);
+
+        out << "}";
+    }
+
+    out << "}";
+
+    first = false;
+}
+
+tracer::tracer()
+    : every(0), skipped(0), lastId(0), recorded(0)
+{
+    names.push_back("");
+}
+
+void tracer::configure(unsigned int every, size_t capacity)
+{
+    tracer::every = every;
+
+    size_t size = every > 0 ? capacity : 0;
+
+    // a reload with the same size keeps what was recorded so far
+    if (events.size() != size)
+    {
+        events.assign(size, trace_event_t());
+        recorded = 0;
+    }
+}
+
+uint16_t tracer::intern(const string &name)
+{
+    unordered_map<string, uint16_t>::iterator it = nameIndex.find(name);
+
+    if (it != nameIndex.end())
+    {
+        return it->second;
+    }
+
+    if (names.size() > UINT16_MAX)
+    {
+        return 0;
+    }
+
+    uint16_t index = names.size();
+
+    names.push_back(name);
+    nameIndex[name] = index;
+
+    return index;
+}
+
+void tracer::record(uint32_t id, trace_stage_t stage, steady_time_t time, const string *worker)
+{
+    if (events.empty())
+    {
+        return;
+    }
+
+    trace_event_t &event = events[recorded % events.size()];
+
+    event.time = chrono::duration_cast<chrono::nanoseconds>(time.time_since_epoch()).count();
+    event.id = id;
+    event.worker = worker != NULL ? intern(*worker) : 0;
+    event.stage = stage;
+
+    recorded++;
+}
+
+long tracer::dump(const string &path)
+{
+    ofstream out(path.c_str());
+
+    if (!out)
+    {
+        return -1;
+    }
+
+    // events of one message, oldest first; messages whose start was overwritten are kept as they are
+    map<uint32_t, vector<const trace_event_t *> > messages;
+
+    uint64_t count = recorded < events.size() ? recorded : events.size();
+
+    for (uint64_t i = recorded - count; i < recorded; i++)
+    {
+        const trace_event_t &event = events[i % events.size()];
+
+        messages[event.id].push_back(&event);
+    }
+
+    bool first = true;
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    for (map<uint32_t, vector<const trace_event_t *> >::iterator it = messages.begin(); it != messages.end(); it++)
+    {
+        vector<const trace_event_t *> &stages = it->second;
+
+        writeEvent(out, first, "b", "message", it->first, stages.front()->time, NULL);
+
+        const trace_event_t *previous = NULL;
+
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            const trace_event_t *event = stages[i];
+            const string        *worker = event->worker != 0 ? &names[event->worker] : NULL;
+
+            if (event->stage == TRACE_ACKED)
+            {
+                writeEvent(out, first, "n", spanNames[event->stage], it->first, event->time, NULL);
+
+                continue;
+            }
+
+            if (previous != NULL)
+            {
+                writeEvent(out, first, "b", spanNames[event->stage], it->first, previous->time, worker);
+                writeEvent(out, first, "e", spanNames[event->stage], it->first, event->time, NULL);
+            }
+
+            previous = event;
+        }
+
+        writeEvent(out, first, "e", "message", it->first, stages.back()->time, NULL);
+    }
+
+    out << "\n]}\n";
+
+    out.close();
+
+    return out ? (long) count : -1;
+}
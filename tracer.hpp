@@ -0,0 +1,85 @@
+#ifndef SERVICE_QUEUE_TRACER_H
+#define SERVICE_QUEUE_TRACER_H
+
+#include "rate_limiter.hpp"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+using namespace std;
+
+typedef enum
+{
+    TRACE_RECEIVED,
+    TRACE_ADMITTED, // rate limiter let a throttled message through
+    TRACE_SELECTED, // worker picked
+    TRACE_SENT,     // written to the output socket or the shared memory ring
+    TRACE_DONE,     // worker reported it done, credit workers only
+    TRACE_LOST,     // worker went away with it in flight
+    TRACE_ACKED     // accepted ack queued for the producer
+} trace_stage_t;
+
+typedef struct
+{
+    int64_t  time; // steady clock, nanoseconds
+    uint32_t id;
+    uint16_t worker; // index in the tracer name table, 0 - none
+    uint16_t stage;
+} trace_event_t;
+
+// Records the path of every N-th input message through the broker into a fixed ring of events, the oldest are
+// overwritten. Written by the broker loop only, so it takes no locks; dump() writes the ring as a Chrome trace.
+class tracer
+{
+
+private:
+    unsigned int every;
+    unsigned int skipped;
+    uint32_t     lastId;
+
+    vector<trace_event_t> events;
+    uint64_t              recorded;
+
+    // worker identities seen in sampled events, index 0 is reserved for none
+    vector<string>                   names;
+    unordered_map<string, uint16_t>  nameIndex;
+
+    uint16_t intern(const string &name);
+
+public:
+    tracer();
+
+    // every 0 disables sampling
+    void configure(unsigned int every, size_t capacity);
+
+    bool enabled() const
+    {
+        return every > 0;
+    }
+
+    // Trace id for the next input message, 0 - not sampled
+    uint32_t sample()
+    {
+        if (every == 0 || ++skipped < every)
+        {
+            return 0;
+        }
+
+        skipped = 0;
+
+        return ++lastId != 0 ? lastId : ++lastId;
+    }
+
+    void record(uint32_t id, trace_stage_t stage, steady_time_t time, const string *worker = NULL);
+
+    void record(uint32_t id, trace_stage_t stage, const string *worker = NULL)
+    {
+        record(id, stage, chrono::steady_clock::now(), worker);
+    }
+
+    // Writes the events in the ring to path, returns the number written or -1
+    long dump(const string &path);
+};
+
+#endif //SERVICE_QUEUE_TRACER_H
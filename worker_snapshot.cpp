@@ -0,0 +1,92 @@
+#include "worker_snapshot.hpp"
+#include "main.hpp"
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+bool writeWorkerSnapshot(const string &path, const vector<worker_snapshot_entry_t> &entries)
+{
+    string temporary = path + ".tmp";
+    FILE  *file      = fopen(temporary.c_str(), "wb");
+
+    if (file == NULL)
+    {
+        ERR << "Worker snapshot: " << temporary << ": " << strerror(errno);
+
+        return false;
+    }
+
+    uint32_t header[3] = {WORKER_SNAPSHOT_MAGIC, WORKER_SNAPSHOT_VERSION, (uint32_t) entries.size()};
+    bool     written   = fwrite(header, sizeof(header), 1, file) == 1;
+
+    for (size_t i = 0; written && i < entries.size(); i++)
+    {
+        uint16_t identitySize     = entries[i].identity.size();
+        uint32_t registrationSize = entries[i].registration.size();
+
+        written = fwrite(&identitySize, sizeof(identitySize), 1, file) == 1 &&
+                  fwrite(&registrationSize, sizeof(registrationSize), 1, file) == 1 &&
+                  fwrite(entries[i].identity.data(), 1, identitySize, file) == identitySize &&
+                  fwrite(entries[i].registration.data(), 1, registrationSize, file) == registrationSize;
+    }
+
+    written = fflush(file) == 0 && written;
+    written = fsync(fileno(file)) == 0 && written;
+
+    if (fclose(file) != 0 || !written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        ERR << "Worker snapshot: " << path << ": " << strerror(errno);
+
+        unlink(temporary.c_str());
+
+        return false;
+    }
+
+    return true;
+}
+
+bool readWorkerSnapshot(const string &path, vector<worker_snapshot_entry_t> &entries)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    uint32_t header[3];
+    bool     valid = fread(header, sizeof(header), 1, file) == 1 &&
+                     header[0] == WORKER_SNAPSHOT_MAGIC && header[1] == WORKER_SNAPSHOT_VERSION;
+
+    for (uint32_t i = 0; valid && i < header[2]; i++)
+    {
+        uint16_t                identitySize;
+        uint32_t                registrationSize;
+        worker_snapshot_entry_t entry;
+
+        valid = fread(&identitySize, sizeof(identitySize), 1, file) == 1 &&
+                fread(&registrationSize, sizeof(registrationSize), 1, file) == 1 &&
+                registrationSize <= 1 << 20;
+
+        if (valid)
+        {
+            entry.identity.resize(identitySize);
+            entry.registration.resize(registrationSize);
+
+            valid = fread(&entry.identity[0], 1, identitySize, file) == identitySize &&
+                    fread(&entry.registration[0], 1, registrationSize, file) == registrationSize;
+        }
+
+        if (valid)
+        {
+            entries.push_back(entry);
+        }
+    }
+
+    fclose(file);
+
+    return valid;
+}
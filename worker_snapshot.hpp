@@ -0,0 +1,28 @@
+#ifndef SERVICE_QUEUE_WORKER_SNAPSHOT_H
+#define SERVICE_QUEUE_WORKER_SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// File layout: [magic u32][version u32][count u32], then per worker
+// [identity size u16][registration size u32][identity][registration request as received]
+
+#define WORKER_SNAPSHOT_MAGIC   0x53515753 // SQWS
+#define WORKER_SNAPSHOT_VERSION 1
+
+typedef struct
+{
+    string identity;
+    string registration; // service.register request, replayed on restore
+} worker_snapshot_entry_t;
+
+// Writes a temporary file and renames it over path, so a crash leaves the previous snapshot intact
+bool writeWorkerSnapshot(const string &path, const vector<worker_snapshot_entry_t> &entries);
+
+// False when the file is missing or damaged, entries read before the damage are kept
+bool readWorkerSnapshot(const string &path, vector<worker_snapshot_entry_t> &entries);
+
+#endif //SERVICE_QUEUE_WORKER_SNAPSHOT_H
@@ -248,6 +248,15 @@ namespace zmq
             return zmq_msg_size (const_cast<zmq_msg_t*>(&msg));
         }
 
+#if ZMQ_VERSION >= ZMQ_MAKE_VERSION(4, 1, 0)
+        //  Returns NULL instead of throwing when the property is absent
+        //  (e.g. "Peer-Address" on inproc/ipc), so it is cheap on hot paths.
+        inline const char *gets (const char *property_) const
+        {
+            return zmq_msg_gets (&msg, property_);
+        }
+#endif
+
     private:
 
         //  The underlying message